@@ -0,0 +1,477 @@
+// ---------------------------------------------------------------------------
+// Offline optimizer for the tripod gait parameters of the hexapod firmware
+//
+// Build:  g++ -O3 -march=native -std=c++17 -pthread contrib/gaitopt.cpp -o gaitopt
+// Run:    ./gaitopt [options] > profile.txt
+//
+// The tool searches TripodCycleTime, HipSwing, FbShift, TripodKneeUp,
+// TripodKneeAdj and the tripod phase weights (see src/params.cpp) with an
+// evolutionary search. Each candidate runs through a model of one cycle of
+// the tripod gait:
+//
+// - Leg geometry and forward kinematics follow src/kinematics.cpp.
+// - Phase timing follows phaseWeights() and setPhaseTiming() in src/legs.cpp.
+//   A phase ends on predicted arrival (servo speed model), but no later than
+//   its share of the cycle time.
+// - Hip collisions use the limits of checkForCrashingHips().
+// - The current estimate uses the constants of the current budget.
+//
+// Candidates are rejected if they:
+// - let the hips collide
+// - exceed the current budget
+// - do not lift the feet clear of the ground
+// - lift a tripod before the other one is (mostly) down
+//
+// The score is the ground speed in mm/s plus a weight times the stability
+// margin in mm. The margin is the smallest distance of the centre of the
+// body to the edges of the support triangle during the stance.
+//
+// Candidates are evaluated in batches laid out as arrays, so the compiler
+// can vectorize the kinematics. Batches are spread over all cores by a work
+// stealing pool.
+//
+// The best profiles are printed in the format the robot takes them: gait
+// parameter commands followed by SaveGaitProfile. SetParam only stages the
+// values, they take effect at the next cycle boundary. SaveGaitProfile saves
+// staged values along with the ones in effect, so the profile is complete
+// even if the robot is walking. The commands can be sent line by line, e.g.
+//
+//   ./gaitopt | while read c; do mosquitto_pub -h $BROKER -t /$BOTID/Command/Cmd -m "$c"; done
+//
+// Keep the constants below in sync with the firmware.
+// ---------------------------------------------------------------------------
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// src/legs.h
+static const float SERVO_MS_PER_60DEG  = 100;
+static const float SERVO_LOAD_FACTOR   = 1.5f;
+static const float SERVO_SAFETY_MARGIN = 10;
+static const float SERVO_FRAME_MS      = 20;
+static const float SERVO_MOVE_MA       = 250;
+static const float SERVO_HOLD_MA       = 20;
+static const float SERVO_FULL_DRIVE    = 10;
+static const float MOTION_TICK_MS      = 10;
+
+// src/positions.h
+static const float HIP_NEUTRAL = 90;
+static const float KNEE_DOWN   = 30;
+
+// src/kinematics.h
+static const float MOUNT_X[6]     = {  60,   0,  -60,  -60,  0,  60 };
+static const float MOUNT_Y[6]     = { -40, -50,  -40,   40, 50,  40 };
+static const float MOUNT_ANGLE[6] = { -45, -90, -135,  135, 90,  45 };
+static const float COXA       = 30;
+static const float FEMUR      = 50;
+static const float KNEE_LEVEL = 90;
+
+static const int TRIPOD1[3] = { 0, 2, 4 };
+static const int TRIPOD2[3] = { 1, 3, 5 };
+
+static const float DEG = 3.14159265f / 180;
+
+/* ------------------------------------------------------------------------- */
+/* Search space, bounds as in src/params.cpp                                 */
+/* ------------------------------------------------------------------------- */
+
+enum { P_CYCLE, P_SWING, P_SHIFT, P_KNEEUP, P_KNEEADJ, P_WLIFT, P_WPUSH, P_WLOWER, NUM_P };
+
+struct Param {
+  const char *name;
+  int min, max;
+};
+
+static const Param PARAMS[NUM_P] = {
+  { "TripodCycleTime",   200, 5000 },
+  { "HipSwing",            0,   80 },
+  { "FbShift",             0,   45 },
+  { "TripodKneeUp",        0,  180 },
+  { "TripodKneeAdj",       0,   90 },
+  { "TripodLiftWeight",    0, 1000 },   // 0 derives the weight from the servo speed model
+  { "TripodPushWeight",    0, 1000 },
+  { "TripodLowerWeight",   0, 1000 },
+};
+
+struct Candidate {
+  int   p[NUM_P];
+  float speed;      // mm/s
+  float margin;     // mm
+  float score;      // -1 if infeasible
+};
+
+struct Options {
+  int   threads    = (int)std::max(1u, std::thread::hardware_concurrency());
+  int   population = 4096;
+  int   generations = 40;
+  int   top        = 3;
+  float stability  = 2.0f;      // score per mm of stability margin
+  float budget     = 2500;      // mA, see SetCurrentBudget
+  float clearance  = 10;        // mm the feet have to be lifted
+  float lowered    = 0.8f;      // share of the lower move done before the other tripod lifts
+  float supplyMV   = 4800;      // see SetServoSupply
+  unsigned seed    = 1;
+  std::string name = "opt";
+};
+
+/* ------------------------------------------------------------------------- */
+/* Model of one tripod cycle, evaluated for a batch of candidates            */
+/* ------------------------------------------------------------------------- */
+
+static const int BATCH = 64;
+
+struct Batch {                     // structure of arrays for vectorization
+  float cycle[BATCH], swing[BATCH], shift[BATCH], kneeup[BATCH];
+  float wlift[BATCH], wpush[BATCH], wlower[BATCH];
+  float speed[BATCH], margin[BATCH], feasible[BATCH];
+  int   count;
+};
+
+// raw hip angle of a leg as setHipFixed() computes it
+static inline float rawHip(int leg, float pos, float adj) {
+  if (leg == 0 || leg == 5) pos -= adj;
+  if (leg == 2 || leg == 3) pos += adj;
+  return leg >= 3 ? 180 - pos : pos;
+}
+
+// forward kinematics, see footPosition()
+static inline void foot(int leg, float hip, float knee, float &x, float &y, float &z) {
+  float elevation = (knee - KNEE_LEVEL) * DEG;
+  float direction = (MOUNT_ANGLE[leg] + 90 - hip) * DEG;
+  float reach     = COXA + FEMUR * std::cos(elevation);
+  x = MOUNT_X[leg] + reach * std::cos(direction);
+  y = MOUNT_Y[leg] + reach * std::sin(direction);
+  z = FEMUR * std::sin(elevation);
+}
+
+// servo speed model, see servoMoveTime()
+static inline float moveTime(float degrees, bool loaded, float supplyMV) {
+  float t = std::fabs(degrees) * SERVO_MS_PER_60DEG / 60;
+  if (loaded) t *= SERVO_LOAD_FACTOR;
+  return t * 4800 / supplyMV;
+}
+
+static inline float moveCurrent(float degrees) {
+  return SERVO_MOVE_MA * std::min(1.0f, std::fabs(degrees) / SERVO_FULL_DRIVE);
+}
+
+// see checkForCrashingHips()
+static bool hipsCrash(const float raw[6]) {
+  for (int leg = 0; leg < 6; leg++) {
+    int next = (leg + 1) % 6;
+    if (raw[leg] <= 85 && raw[next] >= 100 && raw[next] - raw[leg] > 85) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// signed distance of the origin to the triangle of three feet, positive inside
+static float supportMargin(const float x[3], const float y[3]) {
+  float area = (x[1]-x[0])*(y[2]-y[0]) - (x[2]-x[0])*(y[1]-y[0]);
+  float sign = area >= 0 ? 1 : -1;
+  float margin = 1e9f;
+  for (int i = 0; i < 3; i++) {
+    int j = (i + 1) % 3;
+    float ex = x[j]-x[i], ey = y[j]-y[i];
+    float length = std::sqrt(ex*ex + ey*ey);
+    if (length < 1e-3f) return -1e9f;
+    float d = sign * (ex * (0 - y[i]) - ey * (0 - x[i])) / length;
+    margin = std::min(margin, d);
+  }
+  return margin;
+}
+
+static void evaluate(Batch &b, const Options &o) {
+  const float margins = SERVO_FRAME_MS + SERVO_SAFETY_MARGIN;
+
+  for (int i = 0; i < b.count; i++) {
+    float hipforward  = HIP_NEUTRAL + b.swing[i];
+    float hipbackward = HIP_NEUTRAL - b.swing[i];
+    float kneeup      = b.kneeup[i];
+    float kneeTravel  = kneeup - KNEE_DOWN;
+    float hipTravel   = hipforward - hipbackward;
+
+    // predicted time per kind of phase, see phaseWeights()
+    float lift  = moveTime(kneeTravel, false, o.supplyMV) + margins;
+    float push  = moveTime(hipTravel,  true,  o.supplyMV) + margins;
+    float lower = moveTime(kneeTravel, true,  o.supplyMV) + margins;
+    float wl = b.wlift[i]  > 0 ? b.wlift[i]  : lift;
+    float wp = b.wpush[i]  > 0 ? b.wpush[i]  : push;
+    float wd = b.wlower[i] > 0 ? b.wlower[i] : lower;
+    float total = 2 * (wl + wp + wd);
+
+    // a phase ends on predicted arrival or at the end of its slot, on a motion tick
+    float slotLift  = b.cycle[i] * wl / total;
+    float slotPush  = b.cycle[i] * wp / total;
+    float slotLower = b.cycle[i] * wd / total;
+    float tLift  = std::ceil(std::min(slotLift,  lift)  / MOTION_TICK_MS) * MOTION_TICK_MS;
+    float tPush  = std::ceil(std::min(slotPush,  push)  / MOTION_TICK_MS) * MOTION_TICK_MS;
+    float tLower = std::ceil(std::min(slotLower, lower) / MOTION_TICK_MS) * MOTION_TICK_MS;
+    float cycle  = 2 * (tLift + tPush + tLower);
+
+    // how much of each move is done when the next phase starts
+    float fLift  = std::min(1.0f, (tLift  - margins) / (lift  - margins));
+    float fPush  = std::min(1.0f, (tPush  - margins) / (push  - margins));
+    float fLower = std::min(1.0f, (tLower - margins) / (lower - margins));
+
+    // feet clear of the ground when the hips start to swing
+    float zDown = FEMUR * std::sin((KNEE_DOWN - KNEE_LEVEL) * DEG);
+    float zUp   = FEMUR * std::sin((KNEE_DOWN + fLift * kneeTravel - KNEE_LEVEL) * DEG);
+    bool feasible = zUp - zDown >= o.clearance && fLower >= o.lowered && fLift > 0 && fPush > 0;
+
+    // stride of the stance tripod and stability along the stance
+    float stride = 0, margin = 1e9f;
+    const int samples = 5;
+    for (int s = 0; s < samples; s++) {
+      float u = fPush * s / (samples - 1);
+      float fx[3], fy[3];
+      for (int k = 0; k < 3; k++) {
+        int leg = TRIPOD2[k];
+        float hip = hipbackward + u * (hipforward - hipbackward);
+        float z;
+        foot(leg, rawHip(leg, hip, b.shift[i]), KNEE_DOWN, fx[k], fy[k], z);
+      }
+      margin = std::min(margin, supportMargin(fx, fy));
+      if (s == 0 || s == samples - 1) {
+        float mean = (fx[0] + fx[1] + fx[2]) / 3;
+        stride += (s == 0) ? -mean : mean;
+      }
+    }
+    stride = std::fabs(stride);
+
+    // hips at both ends of the push, both tripods
+    float raw[6];
+    for (int end = 0; end < 2; end++) {
+      for (int k = 0; k < 3; k++) {
+        raw[TRIPOD1[k]] = rawHip(TRIPOD1[k], end ? hipforward : hipbackward, b.shift[i]);
+        raw[TRIPOD2[k]] = rawHip(TRIPOD2[k], end ? hipbackward : hipforward, b.shift[i]);
+      }
+      if (hipsCrash(raw)) feasible = false;
+    }
+
+    // estimated current: all hips move during the push, three knees otherwise
+    float current = std::max(6 * moveCurrent(hipTravel * fPush) + 6 * SERVO_HOLD_MA,
+                             3 * moveCurrent(kneeTravel) + 9 * SERVO_HOLD_MA);
+    if (current > o.budget) feasible = false;
+
+    b.speed[i]    = 2 * stride * 1000 / cycle;
+    b.margin[i]   = margin;
+    b.feasible[i] = feasible && margin > 0;
+  }
+}
+
+/* ------------------------------------------------------------------------- */
+/* Work stealing pool                                                        */
+/* ------------------------------------------------------------------------- */
+
+class Pool {
+public:
+  explicit Pool(int threads) : queues(threads), locks(threads) {}
+
+  // run all tasks, each worker starts with its own share and steals when done
+  void run(std::vector<std::function<void()>> &tasks) {
+    int n = queues.size();
+    for (size_t t = 0; t < tasks.size(); t++) {
+      queues[t % n].push_back(&tasks[t]);
+    }
+    std::vector<std::thread> workers;
+    for (int w = 0; w < n; w++) {
+      workers.emplace_back([this, w, n] {
+        std::function<void()> *task;
+        while ((task = next(w, n)) != nullptr) {
+          (*task)();
+        }
+      });
+    }
+    for (auto &worker : workers) worker.join();
+  }
+
+private:
+  std::function<void()>* next(int self, int n) {
+    {
+      std::lock_guard<std::mutex> guard(locks[self]);
+      if (!queues[self].empty()) {
+        auto task = queues[self].back();        // own work from the back
+        queues[self].pop_back();
+        return task;
+      }
+    }
+    for (int i = 1; i < n; i++) {
+      int victim = (self + i) % n;
+      std::lock_guard<std::mutex> guard(locks[victim]);
+      if (!queues[victim].empty()) {
+        auto task = queues[victim].front();     // steal from the front
+        queues[victim].pop_front();
+        return task;
+      }
+    }
+    return nullptr;
+  }
+
+  std::vector<std::deque<std::function<void()>*>> queues;
+  std::vector<std::mutex> locks;
+};
+
+/* ------------------------------------------------------------------------- */
+/* Evolutionary search                                                       */
+/* ------------------------------------------------------------------------- */
+
+// equal scores happen when all phases end on arrival, prefer the shorter cycle time then
+static bool better(const Candidate &a, const Candidate &b) {
+  if (a.score != b.score) return a.score > b.score;
+  return a.p[P_CYCLE] < b.p[P_CYCLE];
+}
+
+static void evaluateAll(std::vector<Candidate> &population, Pool &pool, const Options &o) {
+  std::vector<std::function<void()>> tasks;
+  for (size_t start = 0; start < population.size(); start += BATCH) {
+    tasks.push_back([&population, start, &o] {
+      Batch b;
+      b.count = (int)std::min<size_t>(BATCH, population.size() - start);
+      for (int i = 0; i < b.count; i++) {
+        const int *p = population[start + i].p;
+        b.cycle[i]  = p[P_CYCLE];
+        b.swing[i]  = p[P_SWING];
+        b.shift[i]  = p[P_SHIFT];
+        b.kneeup[i] = p[P_KNEEUP] + p[P_KNEEADJ];   // submode 1, see walkTripodGait()
+        b.wlift[i]  = p[P_WLIFT];
+        b.wpush[i]  = p[P_WPUSH];
+        b.wlower[i] = p[P_WLOWER];
+      }
+      evaluate(b, o);
+      for (int i = 0; i < b.count; i++) {
+        Candidate &c = population[start + i];
+        c.speed  = b.speed[i];
+        c.margin = b.margin[i];
+        c.score  = b.feasible[i] ? c.speed + o.stability * c.margin : -1;
+      }
+    });
+  }
+  pool.run(tasks);
+}
+
+static int randomValue(std::mt19937 &rng, int p) {
+  if (p >= P_WLIFT && rng() % 4 == 0) {
+    return 0;                                     // derived weight
+  }
+  return std::uniform_int_distribution<int>(PARAMS[p].min, PARAMS[p].max)(rng);
+}
+
+static Candidate mutate(const Candidate &parent, std::mt19937 &rng, float strength) {
+  Candidate c = parent;
+  for (int p = 0; p < NUM_P; p++) {
+    if (rng() % 3) continue;
+    if (p >= P_WLIFT && rng() % 8 == 0) {
+      c.p[p] = c.p[p] ? 0 : randomValue(rng, p);
+      continue;
+    }
+    float range = (PARAMS[p].max - PARAMS[p].min) * strength;
+    int delta = (int)std::lround(std::normal_distribution<float>(0, range)(rng));
+    c.p[p] = std::clamp(c.p[p] + delta, PARAMS[p].min, PARAMS[p].max);
+  }
+  return c;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+    "usage: gaitopt [options]\n"
+    "  -t <threads>      worker threads (default: all cores)\n"
+    "  -p <population>   candidates per generation (default 4096)\n"
+    "  -g <generations>  generations (default 40)\n"
+    "  -n <top>          profiles to export (default 3)\n"
+    "  -s <weight>       score per mm of stability margin (default 2)\n"
+    "  -b <mA>           current budget (default 2500)\n"
+    "  -c <mm>           foot clearance (default 10)\n"
+    "  -l <share>        share of the lower move done before the next lift (default 0.8)\n"
+    "  -v <mV>           servo supply (default 4800)\n"
+    "  -r <seed>         random seed (default 1)\n"
+    "  -o <name>         profile name prefix (default opt)\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  Options o;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] != '-' || argv[i][2] || i + 1 >= argc) usage();
+    const char *v = argv[++i];
+    switch (argv[i-1][1]) {
+      case 't': o.threads     = std::max(1, atoi(v)); break;
+      case 'p': o.population  = std::max(BATCH, atoi(v)); break;
+      case 'g': o.generations = std::max(1, atoi(v)); break;
+      case 'n': o.top         = std::max(1, atoi(v)); break;
+      case 's': o.stability   = atof(v); break;
+      case 'b': o.budget      = atof(v); break;
+      case 'c': o.clearance   = atof(v); break;
+      case 'l': o.lowered     = atof(v); break;
+      case 'v': o.supplyMV    = atof(v); break;
+      case 'r': o.seed        = atoi(v); break;
+      case 'o': o.name        = v; break;
+      default:  usage();
+    }
+  }
+
+  Pool pool(o.threads);
+  std::mt19937 rng(o.seed);
+  std::vector<Candidate> population(o.population);
+
+  // the firmware defaults are part of the first generation
+  population[0] = { { 750, 25, 15, 50, 30, 0, 0, 0 }, 0, 0, 0 };
+  for (size_t i = 1; i < population.size(); i++) {
+    for (int p = 0; p < NUM_P; p++) population[i].p[p] = randomValue(rng, p);
+  }
+  evaluateAll(population, pool, o);
+  Candidate defaults = population[0];
+
+  size_t elite = std::max<size_t>(o.top, population.size() / 16);
+  for (int g = 0; g < o.generations; g++) {
+    std::sort(population.begin(), population.end(),
+              better);
+    fprintf(stderr, "generation %2d: best %.1f (%.1f mm/s, margin %.1f mm)\n",
+            g, population[0].score, population[0].speed, population[0].margin);
+
+    float strength = 0.2f * (1 - (float)g / o.generations) + 0.01f;
+    for (size_t i = elite; i < population.size(); i++) {
+      if (i % 8 == 0) {
+        for (int p = 0; p < NUM_P; p++) population[i].p[p] = randomValue(rng, p);
+      } else {
+        population[i] = mutate(population[rng() % elite], rng, strength);
+      }
+    }
+    evaluateAll(population, pool, o);
+  }
+  std::sort(population.begin(), population.end(),
+            better);
+
+  fprintf(stderr, "firmware defaults: score %.1f (%.1f mm/s, margin %.1f mm)%s\n",
+          defaults.score, defaults.speed, defaults.margin, defaults.score < 0 ? " infeasible" : "");
+
+  // export distinct profiles in the command format of the robot
+  std::vector<Candidate> best;
+  for (const Candidate &c : population) {
+    if (c.score < 0 || (int)best.size() >= o.top) break;
+    bool duplicate = std::any_of(best.begin(), best.end(),
+                                 [&c](const Candidate &b) { return !memcmp(b.p, c.p, sizeof(c.p)); });
+    if (!duplicate) best.push_back(c);
+  }
+  for (size_t n = 0; n < best.size(); n++) {
+    fprintf(stderr, "%s%zu: score %.1f (%.1f mm/s, margin %.1f mm)\n",
+            o.name.c_str(), n + 1, best[n].score, best[n].speed, best[n].margin);
+    for (int p = 0; p < NUM_P; p++) {
+      printf("SetParam %s %d\n", PARAMS[p].name, best[n].p[p]);
+    }
+    printf("SaveGaitProfile %s%zu\n", o.name.c_str(), n + 1);
+  }
+  return best.empty() ? 1 : 0;
+}
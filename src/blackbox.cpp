@@ -0,0 +1,165 @@
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Post-mortem black box in RTC memory                                                */
+/*                                                                                     */
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Copyright 2024 by Bodo Bauer <bb@bb-zone.com>                                      */
+/*                                                                                     */
+/*  This program is free software: you can redistribute it and/or modify               */
+/*  it under the terms of the GNU General Public License as published by               */
+/*  the Free Software Foundation, either version 3 of the License, or                  */
+/*  (at your option) any later version.                                                */
+/*                                                                                     */
+/*  This program is distributed in the hope that it will be useful,                    */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of                     */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                      */
+/*  GNU General Public License for more details.                                       */
+/*                                                                                     */
+/*  You should have received a copy of the GNU General Public License                  */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.              */
+#include <Arduino.h>
+#include "legs.h"
+#include "wifi.h"
+#include "mqtt.h"
+#include "blackbox.h"
+
+/* *********************************************************************************** *
+ * The last few seconds of commands, committed frames, servo driver sleep and overruns
+ * are kept in a circular log in the RTC user memory, which survives resets (but not a
+ * power cycle). At boot the log of the previous run is copied to RAM and published
+ * together with the reset reason as soon as MQTT is connected, one message per entry
+ * with the topic /<myId>/BlackBox.
+ *
+ * Entries are written from the loop as well as from the motion task. Neither yields 
+ * while writing, so the two never interleave.
+ * *********************************************************************************** */
+
+static blackbox_t    box;              // RAM copy of the RTC log being written
+static blackbox_t    last;             // log of the previous run
+static bool          lastValid = false;
+static int           published = -1;   // entries of the previous run published so far, -1 = none yet
+static char          resetReason[48];
+
+/* *********************************************************************************** */
+/* @brief Write an entry and the header to RTC memory                                  */
+/* *********************************************************************************** */
+void blackboxWrite(byte type, byte arg, const uint8_t *data, int length) {
+  bbentry_t *e = &box.entry[box.head];
+
+  e->time = millis();
+  e->type = type;
+  e->arg  = arg;
+  memset(e->data, 0, BLACKBOX_DATA_LEN);
+  if (length > 0) {
+    memcpy(e->data, data, min(length, BLACKBOX_DATA_LEN));
+  }
+
+  ESP.rtcUserMemoryWrite(BLACKBOX_RTC_OFFSET + (offsetof(blackbox_t, entry) + box.head*sizeof(bbentry_t))/4,
+                         (uint32_t*)e, sizeof(bbentry_t));
+  box.head = (box.head + 1) % BLACKBOX_ENTRIES;
+  if (box.count < BLACKBOX_ENTRIES) {
+    box.count++;
+  }
+  ESP.rtcUserMemoryWrite(BLACKBOX_RTC_OFFSET, (uint32_t*)&box, offsetof(blackbox_t, entry));
+}
+
+/* *********************************************************************************** */
+/* @brief Keep the log of the previous run and start a new one                         */
+/* *********************************************************************************** */
+void initBlackBox(void) {
+  ESP.rtcUserMemoryRead(BLACKBOX_RTC_OFFSET, (uint32_t*)&last, sizeof(last));
+  lastValid = last.magic == BLACKBOX_MAGIC && last.head < BLACKBOX_ENTRIES && last.count <= BLACKBOX_ENTRIES;
+  snprintf(resetReason, sizeof(resetReason), "%s", ESP.getResetReason().c_str());
+
+  box.magic = BLACKBOX_MAGIC;
+  box.head  = 0;
+  box.count = 0;
+  ESP.rtcUserMemoryWrite(BLACKBOX_RTC_OFFSET, (uint32_t*)&box, offsetof(blackbox_t, entry));
+}
+
+/* *********************************************************************************** *
+ * @brief Publish the log of the previous run
+ *
+ * Hands one entry at a time to the outbound queue, as long as the queue is not busy.
+ * *********************************************************************************** */
+void publishBlackBox(void) {
+  char message[128];
+
+  if (!client.connected() || MqttQueueDepth > MQTT_QUEUE_LEN/2 || published >= (int)(lastValid ? last.count : 0)) {
+    return;
+  }
+  if (published < 0) {
+    snprintf(message, sizeof(message), "Reset reason: %s, %d entries", resetReason, lastValid ? last.count : 0);
+    mqttSendMessage("/%s/BlackBox", message);
+    published = 0;
+    return;
+  }
+
+  // oldest entry first, times relative to the newest entry
+  int newest = (last.head + BLACKBOX_ENTRIES - 1) % BLACKBOX_ENTRIES;
+  int index  = (last.head + BLACKBOX_ENTRIES - last.count + published) % BLACKBOX_ENTRIES;
+  bbentry_t *e = &last.entry[index];
+  uint16_t age = last.entry[newest].time - e->time;
+  int length = snprintf(message, sizeof(message), "#%d -%ums ", published, age);
+
+  switch (e->type) {
+    case BB_COMMAND:
+      snprintf(message+length, sizeof(message)-length, "command %.*s", min((int)e->arg, BLACKBOX_DATA_LEN), (char*)e->data);
+      break;
+    case BB_FRAME:
+      length += snprintf(message+length, sizeof(message)-length, "frame phase %d:", e->arg);
+      for (int servo = 0; servo < NUM_SERVO; servo++) {
+        length += snprintf(message+length, sizeof(message)-length, " %d", e->data[servo]);
+      }
+      break;
+    case BB_SERVO_SLEEP:
+      snprintf(message+length, sizeof(message)-length, "servo driver asleep, recovery #%d", e->arg);
+      break;
+    case BB_OVERRUN:
+      snprintf(message+length, sizeof(message)-length, "%s overrun %ums", e->arg ? "motion" : "loop", 
+               e->data[0] | (e->data[1] << 8));
+      break;
+    default:
+      snprintf(message+length, sizeof(message)-length, "unknown entry %d", e->type);
+      break;
+  }
+  mqttSendMessage("/%s/BlackBox", message);
+  published++;
+}
+
+/* *********************************************************************************** */
+/* @brief Record a command                                                             */
+/* *********************************************************************************** */
+void blackboxCommand(const char *cmd) {
+  int length = strlen(cmd);
+  blackboxWrite(BB_COMMAND, min(length, 255), (const uint8_t*)cmd, length);
+}
+
+/* *********************************************************************************** */
+/* @brief Record the frame just committed                                              */
+/* *********************************************************************************** */
+void blackboxFrame(byte phase) {
+  uint8_t joints[NUM_SERVO];
+
+  for (int servo = 0; servo < NUM_SERVO; servo++) {
+    unsigned short pos = servoPosition(servo);
+    joints[servo] = (pos == SERVO_UNKNOWN) ? 255 : ANGLE_DEG(pos);
+  }
+  blackboxWrite(BB_FRAME, phase, joints, NUM_SERVO);
+}
+
+/* *********************************************************************************** */
+/* @brief Record the servo driver falling asleep                                       */
+/* *********************************************************************************** */
+void blackboxServoSleep(unsigned long recoveries) {
+  blackboxWrite(BB_SERVO_SLEEP, min(recoveries, 255UL), NULL, 0);
+}
+
+/* *********************************************************************************** */
+/* @brief Record a loop (context 0) or motion task (context 1) that took too long      */
+/* *********************************************************************************** */
+void blackboxOverrun(byte context, unsigned long ms) {
+  uint8_t duration[2] = { (uint8_t)min(ms, 0xFFFFUL), (uint8_t)(min(ms, 0xFFFFUL) >> 8) };
+  blackboxWrite(BB_OVERRUN, context, duration, 2);
+}
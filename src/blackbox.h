@@ -0,0 +1,72 @@
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Post-mortem black box in RTC memory                                                */
+/*                                                                                     */
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Copyright 2024 by Bodo Bauer <bb@bb-zone.com>                                      */
+/*                                                                                     */
+/*  This program is free software: you can redistribute it and/or modify               */
+/*  it under the terms of the GNU General Public License as published by               */
+/*  the Free Software Foundation, either version 3 of the License, or                  */
+/*  (at your option) any later version.                                                */
+/*                                                                                     */
+/*  This program is distributed in the hope that it will be useful,                    */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of                     */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                      */
+/*  GNU General Public License for more details.                                       */
+/*                                                                                     */
+/*  You should have received a copy of the GNU General Public License                  */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.              */
+#include <Arduino.h>
+
+#ifndef BLACKBOX_H
+#define BLACKBOX_H
+
+/* *********************************************************************************** */
+/* Black box settings                                                                  */
+/* *********************************************************************************** */
+
+#define BLACKBOX_MAGIC      0x48584242UL  // "BBXH"
+#define BLACKBOX_RTC_OFFSET 32            // in 4 byte blocks, the first 128 bytes are used by eboot
+#define BLACKBOX_ENTRIES    23            // 8 byte header + 23 * 16 byte entries = 376 bytes
+#define BLACKBOX_DATA_LEN   12
+#define BLACKBOX_LOOP_OVERRUN 100         // loop() runs longer than this many ms are recorded
+
+// entry types
+#define BB_COMMAND          1   // arg: length, data: start of the command
+#define BB_FRAME            2   // arg: gait phase, data: joint positions in degrees (255 unknown)
+#define BB_SERVO_SLEEP      3   // arg: recoveries
+#define BB_OVERRUN          4   // arg: 0 loop, 1 motion task, data[0..1]: duration in ms
+
+/* *********************************************************************************** */
+/* Custom Types                                                                        */
+/* *********************************************************************************** */
+
+typedef struct {                          // 16 bytes
+  uint16_t time;                          // low 16 bits of millis()
+  uint8_t  type;
+  uint8_t  arg;
+  uint8_t  data[BLACKBOX_DATA_LEN];
+} bbentry_t;
+
+typedef struct {
+  uint32_t  magic;
+  uint16_t  head;                         // next entry to be written
+  uint16_t  count;                        // valid entries
+  bbentry_t entry[BLACKBOX_ENTRIES];
+} blackbox_t;
+
+/* *********************************************************************************** */
+/* Prototypes                                                                          */
+/* *********************************************************************************** */
+
+void initBlackBox(void);                             // keep the log of the last run, start a new one
+void publishBlackBox(void);                          // publish the last run once MQTT is up (call in loop)
+
+void blackboxCommand(const char *cmd);
+void blackboxFrame(byte phase);
+void blackboxServoSleep(unsigned long recoveries);
+void blackboxOverrun(byte context, unsigned long ms);
+
+#endif
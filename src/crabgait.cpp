@@ -0,0 +1,189 @@
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Crab Gait: walk in any direction without turning                                   */
+/*                                                                                     */
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Copyright 2024 by Bodo Bauer <bb@bb-zone.com>                                      */
+/*                                                                                     */
+/*  This program is free software: you can redistribute it and/or modify               */
+/*  it under the terms of the GNU General Public License as published by               */
+/*  the Free Software Foundation, either version 3 of the License, or                  */
+/*  (at your option) any later version.                                                */
+/*                                                                                     */
+/*  This program is distributed in the hope that it will be useful,                    */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of                     */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                      */
+/*  GNU General Public License for more details.                                       */
+/*                                                                                     */
+/*  You should have received a copy of the GNU General Public License                  */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.              */
+/* *********************************************************************************** */
+#include "Arduino.h"
+#include "positions.h"
+#include "crabgait.h"
+#include "hexabot.h"
+#include "legs.h"
+#include "kinematics.h"
+
+/* *********************************************************************************** *
+ * The crab gait plans the feet in the body frame instead of joint angles: while one
+ * tripod carries the body and its feet slide along the heading, the other tripod swings
+ * its feet back to the front on a raised arc. All six feet are solved by the inverse
+ * kinematics on every motion tick, so the body can move in any heading without turning.
+ *
+ * With two joints per leg the feet can only be placed by direction and height, the 
+ * reach follows. A foot moving straight along its own leg therefore stays put (e.g. the
+ * middle legs when walking sideways). To see what the gait actually achieves, the feet
+ * of each tripod are taken from the forward kinematics at the start and end of their 
+ * stance. CrabCommanded and CrabAchieved sum up the distance the body should have moved
+ * and the distance the stance feet moved it along the heading.
+ * *********************************************************************************** */
+
+int  CrabHeading   = 0;             // degrees, 0 is forward, 90 is left
+long CrabCommanded = 0;             // mm the body was commanded to move
+long CrabAchieved  = 0;             // mm the stance feet moved it
+
+#define CRAB_RESTART   500          // ms without a run before the gait starts over
+#define CRAB_STEPS    1024          // resolution of the position within a half cycle
+
+static foot_t        neutral[NUM_LEGS];      // feet with hips and knees at their stand position
+static foot_t        stanceStart[NUM_LEGS];  // feet when their tripod started carrying the body
+static unsigned long cycleStart = 0;
+static unsigned long lastRun    = 0;
+static bool          running    = false;
+static int           lastHalf   = 0;
+
+void gait_crab(int heading, int stride, int lift, long timeperiod);
+
+/* *********************************************************************************** *
+ * @brief Process walking commands in Crab Gait manner
+ *
+ * Forward and backward walk along the heading, left and right sideways to it.
+ * *********************************************************************************** */
+void walkCrabGait(byte command) {
+  switch (command) {
+    case COMMAND_FORWARD:
+      gait_crab(CrabHeading,       CRAB_STRIDE, CRAB_LIFT, CRAB_CYCLE_TIME);
+      break;
+
+    case COMMAND_BACKWARD:
+      gait_crab(CrabHeading + 180, CRAB_STRIDE, CRAB_LIFT, CRAB_CYCLE_TIME);
+      break;
+
+    case COMMAND_LEFT:
+      gait_crab(CrabHeading + 90,  CRAB_STRIDE, CRAB_LIFT, CRAB_CYCLE_TIME);
+      break;
+
+    case COMMAND_RIGHT:
+      gait_crab(CrabHeading - 90,  CRAB_STRIDE, CRAB_LIFT, CRAB_CYCLE_TIME);
+      break;
+
+    case COMMAND_STOMP:
+      gait_crab(CrabHeading,       0,           CRAB_LIFT, CRAB_CYCLE_TIME);
+      break;
+
+    case COMMAND_STAND:
+      stand();
+      break;
+  }
+}
+
+/* *********************************************************************************** */
+/* @brief Set the heading forward and backward walk along, in degrees (0 is forward)   */
+/* *********************************************************************************** */
+void setCrabHeading(int degrees) {
+  CrabHeading = ((degrees % 360) + 360) % 360;
+}
+
+/* *********************************************************************************** *
+ * @brief Sum up how far the body has been moved by a tripod which ends its stance
+ * *********************************************************************************** */
+void crabAccount(int legmask, int heading, int stride) {
+  long moved = 0;
+  int  legs  = 0;
+  for (int leg = 0; leg < NUM_LEGS; leg++) {
+    unsigned short hip  = servoPosition(leg);
+    unsigned short knee = servoPosition(leg + KNEE_OFFSET);
+    if (!(legmask & (1 << leg)) || hip == SERVO_UNKNOWN || knee == SERVO_UNKNOWN) {
+      continue;
+    }
+    foot_t end;
+    footPosition(leg, hip, knee, &end);
+    // the body moves opposite to the feet on the ground
+    moved -= ((long)(end.x - stanceStart[leg].x) * icos(ANGLE(heading)) +
+              (long)(end.y - stanceStart[leg].y) * isin(ANGLE(heading))) / SINE_ONE;
+    legs++;
+  }
+  if (legs > 0) {
+    CrabCommanded += stride;
+    CrabAchieved  += moved / legs;
+  }
+}
+
+/* *********************************************************************************** *
+ * @brief Remember where the feet of a tripod are when it starts carrying the body
+ * *********************************************************************************** */
+void crabStance(int legmask) {
+  for (int leg = 0; leg < NUM_LEGS; leg++) {
+    if (legmask & (1 << leg)) {
+      footPosition(leg, servoPosition(leg), servoPosition(leg + KNEE_OFFSET), &stanceStart[leg]);
+    }
+  }
+}
+
+/* *********************************************************************************** *
+ * @brief walk along a heading without turning the body
+ *
+ * The cycle consists of two halves: in the first one TRIPOD1_LEGS swing and 
+ * TRIPOD2_LEGS carry the body, in the second one the other way round. The servo frame 
+ * is committed by the motion task.
+ * *********************************************************************************** */
+void gait_crab(int heading, int stride, int lift, long timeperiod) {
+  unsigned long now = hexmillis();
+
+  if (!running || now - lastRun > CRAB_RESTART) {
+    for (int leg = 0; leg < NUM_LEGS; leg++) {
+      footPosition(leg, ANGLE(HIP_NEUTRAL), ANGLE(KNEE_STAND), &neutral[leg]);
+    }
+    cycleStart = now;
+    lastHalf   = 0;
+    crabStance(TRIPOD2_LEGS);
+    running    = true;
+  }
+  lastRun = now;
+
+  long t    = (now - cycleStart) % timeperiod;
+  int  half = (2 * t) / timeperiod;
+  long step = ((2 * t) % timeperiod) * CRAB_STEPS / timeperiod;   // 0..CRAB_STEPS within the half
+  int  swing   = half ? TRIPOD2_LEGS : TRIPOD1_LEGS;
+  int  support = half ? TRIPOD1_LEGS : TRIPOD2_LEGS;
+
+  if (half != lastHalf) {
+    crabAccount(swing, heading, stride);      // the swinging tripod just ended its stance
+    if (half == 0 && gaitCycleBoundary()) {
+      running = false;                         // start over with the new gait parameters
+      return;
+    }
+    crabStance(support);
+    lastHalf = half;
+  }
+  GaitPhase = half * 4 + step / (CRAB_STEPS / 4);
+
+  long dx = ((long)stride * icos(ANGLE(heading))) / SINE_ONE;
+  long dy = ((long)stride * isin(ANGLE(heading))) / SINE_ONE;
+
+  for (int leg = 0; leg < NUM_LEGS; leg++) {
+    foot_t target = neutral[leg];
+    long along;                                // -CRAB_STEPS/2 (back) to CRAB_STEPS/2 (front)
+    if (swing & (1 << leg)) {
+      along = step - CRAB_STEPS/2;
+      target.z += ((long)lift * isin((ANGLE(180) * step) / CRAB_STEPS)) / SINE_ONE;
+    } else {
+      along = CRAB_STEPS/2 - step;
+    }
+    target.x += (dx * along) / CRAB_STEPS;
+    target.y += (dy * along) / CRAB_STEPS;
+    setFoot(leg, &target);
+  }
+}
@@ -0,0 +1,41 @@
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Crab Gait: walk in any direction without turning                                   */
+/*                                                                                     */
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Copyright 2024 by Bodo Bauer <bb@bb-zone.com>                                      */
+/*                                                                                     */
+/*  This program is free software: you can redistribute it and/or modify               */
+/*  it under the terms of the GNU General Public License as published by               */
+/*  the Free Software Foundation, either version 3 of the License, or                  */
+/*  (at your option) any later version.                                                */
+/*                                                                                     */
+/*  This program is distributed in the hope that it will be useful,                    */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of                     */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                      */
+/*  GNU General Public License for more details.                                       */
+/*                                                                                     */
+/*  You should have received a copy of the GNU General Public License                  */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.              */
+/* *********************************************************************************** */
+#include "Arduino.h"
+#include "positions.h"
+#include "hexabot.h"
+#include "params.h"
+
+#ifndef CRABGAIT_H
+#define CRABGAIT_H
+
+#define CRAB_CYCLE_TIME   (GaitParams.crabCycleTime)   // ms for a full cycle of both tripods
+#define CRAB_STRIDE       (GaitParams.crabStride)      // mm the body moves per half cycle
+#define CRAB_LIFT         (GaitParams.crabLift)        // mm the feet are lifted during the swing
+
+extern int  CrabHeading;
+extern long CrabCommanded;
+extern long CrabAchieved;
+
+void walkCrabGait(byte command);
+void setCrabHeading(int degrees);
+
+#endif
@@ -28,6 +28,7 @@
 #define MODE_RIPPLE  'B'       // Ripple Gait
 #define MODE_QUAD    'C'       // Quad Gait
 #define MODE_WAVE    'D'       // Waving motions
+#define MODE_CRAB    'E'       // Crab Gait, walk in any direction
 
 #define SUBMODE_1    '1'
 #define SUBMODE_2    '2'
@@ -0,0 +1,234 @@
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Fixed point leg kinematics                                                         */
+/*                                                                                     */
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Copyright 2024 by Bodo Bauer <bb@bb-zone.com>                                      */
+/*                                                                                     */
+/*  This program is free software: you can redistribute it and/or modify               */
+/*  it under the terms of the GNU General Public License as published by               */
+/*  the Free Software Foundation, either version 3 of the License, or                  */
+/*  (at your option) any later version.                                                */
+/*                                                                                     */
+/*  This program is distributed in the hope that it will be useful,                    */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of                     */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                      */
+/*  GNU General Public License for more details.                                       */
+/*                                                                                     */
+/*  You should have received a copy of the GNU General Public License                  */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.              */
+#include <Arduino.h>
+#include "kinematics.h"
+
+/* *********************************************************************************** *
+ * The legs have two joints: the hip turns the leg in the horizontal plane, the knee
+ * raises and lowers it. A foot can therefore be placed at any direction and height
+ * within reach, its distance from the hip follows from the height. footAngles() 
+ * honors x and y by direction and z exactly.
+ *
+ * All math is integer: angles are fixed point (1/16 degree), sine and arctangent come
+ * from tables in flash with linear interpolation. Solving all six legs takes a few 
+ * hundred multiplications, well within a motion tick.
+ * *********************************************************************************** */
+
+leggeometry_t LegGeometry[NUM_LEGS] = {
+  {  LEG_MOUNT_FRONT_X, -LEG_MOUNT_FRONT_Y,  -45, LEG_COXA, LEG_FEMUR, LEG_KNEE_LEVEL },  // Leg 0 - front right
+  {                  0, -LEG_MOUNT_MID_Y,    -90, LEG_COXA, LEG_FEMUR, LEG_KNEE_LEVEL },  // Leg 1 - middle right
+  { -LEG_MOUNT_FRONT_X, -LEG_MOUNT_FRONT_Y, -135, LEG_COXA, LEG_FEMUR, LEG_KNEE_LEVEL },  // Leg 2 - back right
+  { -LEG_MOUNT_FRONT_X,  LEG_MOUNT_FRONT_Y,  135, LEG_COXA, LEG_FEMUR, LEG_KNEE_LEVEL },  // Leg 3 - back left
+  {                  0,  LEG_MOUNT_MID_Y,     90, LEG_COXA, LEG_FEMUR, LEG_KNEE_LEVEL },  // Leg 4 - middle left
+  {  LEG_MOUNT_FRONT_X,  LEG_MOUNT_FRONT_Y,   45, LEG_COXA, LEG_FEMUR, LEG_KNEE_LEVEL },  // Leg 5 - front left
+};
+
+// sin(k degrees) * SINE_ONE for k = 0..90
+static const int16_t SineTable[91] PROGMEM = {
+      0,   286,   572,   857,  1143,  1428,  1713,  1997,  2280,  2563,
+   2845,  3126,  3406,  3686,  3964,  4240,  4516,  4790,  5063,  5334,
+   5604,  5872,  6138,  6402,  6664,  6924,  7182,  7438,  7692,  7943,
+   8192,  8438,  8682,  8923,  9162,  9397,  9630,  9860, 10087, 10311,
+  10531, 10749, 10963, 11174, 11381, 11585, 11786, 11982, 12176, 12365,
+  12551, 12733, 12911, 13085, 13255, 13421, 13583, 13741, 13894, 14044,
+  14189, 14330, 14466, 14598, 14726, 14849, 14968, 15082, 15191, 15296,
+  15396, 15491, 15582, 15668, 15749, 15826, 15897, 15964, 16026, 16083,
+  16135, 16182, 16225, 16262, 16294, 16322, 16344, 16362, 16374, 16382,
+  16384,
+};
+
+// atan(k/64) in 1/16 degree for k = 0..64
+static const int16_t AtanTable[65] PROGMEM = {
+      0,    14,    29,    43,    57,    71,    86,   100,   114,   128,
+    142,   156,   170,   184,   197,   211,   225,   238,   251,   265,
+    278,   291,   304,   316,   329,   341,   354,   366,   378,   390,
+    402,   414,   425,   436,   448,   459,   470,   481,   491,   502,
+    512,   522,   532,   542,   552,   562,   571,   581,   590,   599,
+    608,   617,   626,   634,   642,   651,   659,   667,   675,   683,
+    690,   698,   705,   713,   720,};
+
+/* *********************************************************************************** */
+/* @brief Bring an angle into the range -180 to 180 degrees                            */
+/* *********************************************************************************** */
+fixangle_t normalizeAngle(fixangle_t a) {
+  a %= ANGLE(360);
+  if (a > ANGLE(180)) {
+    a -= ANGLE(360);
+  } else if (a <= -ANGLE(180)) {
+    a += ANGLE(360);
+  }
+  return a;
+}
+
+/* *********************************************************************************** */
+/* @brief Sine of a fixed point angle, scaled to SINE_ONE                              */
+/* *********************************************************************************** */
+int isin(fixangle_t a) {
+  a = normalizeAngle(a);
+  int sign = 1;
+  if (a < 0) {
+    a = -a;
+    sign = -1;
+  }
+  if (a > ANGLE(90)) {
+    a = ANGLE(180) - a;                   // sin(180-a) = sin(a)
+  }
+  int deg  = ANGLE_DEG(a);
+  int frac = a & ((1 << ANGLE_SHIFT) - 1);
+  int s    = (int16_t)pgm_read_word(&SineTable[deg]);
+  if (frac) {
+    int next = (int16_t)pgm_read_word(&SineTable[deg+1]);
+    s += ((next - s) * frac) >> ANGLE_SHIFT;
+  }
+  return sign * s;
+}
+
+/* *********************************************************************************** */
+/* @brief Cosine of a fixed point angle, scaled to SINE_ONE                            */
+/* *********************************************************************************** */
+int icos(fixangle_t a) {
+  return isin(a + ANGLE(90));
+}
+
+/* *********************************************************************************** *
+ * @brief Arctangent of y/x in the range -180 to 180 degrees
+ *
+ * The table covers the first octant, the others follow by symmetry.
+ * *********************************************************************************** */
+fixangle_t iatan2(long y, long x) {
+  long ax = abs(x);
+  long ay = abs(y);
+  if (ax == 0 && ay == 0) {
+    return 0;
+  }
+
+  long big   = max(ax, ay);
+  long small = min(ax, ay);
+  long ratio = (small << 10) / big;       // 0..1024, i.e. 64 table steps of 16
+  int  index = ratio >> 4;
+  int  frac  = ratio & 15;
+  fixangle_t a = (int16_t)pgm_read_word(&AtanTable[index]);
+  if (frac) {
+    int next = (int16_t)pgm_read_word(&AtanTable[index+1]);
+    a += ((next - a) * frac) >> 4;
+  }
+
+  if (ay > ax) a = ANGLE(90) - a;
+  if (x < 0)   a = ANGLE(180) - a;
+  if (y < 0)   a = -a;
+  return a;
+}
+
+/* *********************************************************************************** */
+/* @brief Integer square root                                                          */
+/* *********************************************************************************** */
+unsigned long isqrt(unsigned long n) {
+  unsigned long root = 0;
+  unsigned long bit  = 1UL << 30;
+
+  while (bit > n) {
+    bit >>= 2;
+  }
+  while (bit != 0) {
+    if (n >= root + bit) {
+      n    -= root + bit;
+      root  = (root >> 1) + bit;
+    } else {
+      root >>= 1;
+    }
+    bit >>= 2;
+  }
+  return root;
+}
+
+/* *********************************************************************************** *
+ * @brief Inverse kinematics: joint angles placing a foot at a position
+ *
+ * The hip turns the leg towards x/y, the knee bends it to reach the height z. 
+ *
+ * @retval 'true'   if the foot can be placed there,
+ *         'false'  if the position is out of reach, the angles are the closest possible
+ * *********************************************************************************** */
+bool footAngles(int leg, const foot_t *foot, fixangle_t *hip, fixangle_t *knee) {
+  const leggeometry_t *g = &LegGeometry[leg];
+  bool reachable = true;
+
+  fixangle_t direction = iatan2(foot->y - g->mountY, foot->x - g->mountX);
+  fixangle_t h = normalizeAngle(ANGLE(g->mountAngle + 90) - direction);
+  if (h < 0 || h > ANGLE(180)) {
+    reachable = false;
+  }
+  *hip = constrain(h, 0, ANGLE(180));
+
+  long z = foot->z;
+  if (abs(z) > g->femur) {
+    reachable = false;
+    z = constrain(z, -(long)g->femur, (long)g->femur);
+  }
+  fixangle_t elevation = iatan2(z, isqrt((unsigned long)g->femur*g->femur - z*z));
+  fixangle_t k = ANGLE(g->kneeLevel) + elevation;
+  if (k < 0 || k > ANGLE(180)) {
+    reachable = false;
+  }
+  *knee = constrain(k, 0, ANGLE(180));
+
+  return reachable;
+}
+
+/* *********************************************************************************** */
+/* @brief Forward kinematics: position of a foot for the given joint angles            */
+/* *********************************************************************************** */
+void footPosition(int leg, fixangle_t hip, fixangle_t knee, foot_t *foot) {
+  const leggeometry_t *g = &LegGeometry[leg];
+
+  fixangle_t elevation = knee - ANGLE(g->kneeLevel);
+  fixangle_t direction = ANGLE(g->mountAngle + 90) - hip;
+  long reach = g->coxa + ((long)g->femur * icos(elevation)) / SINE_ONE;
+
+  foot->x = g->mountX + (reach * icos(direction)) / SINE_ONE;
+  foot->y = g->mountY + (reach * isin(direction)) / SINE_ONE;
+  foot->z = ((long)g->femur * isin(elevation)) / SINE_ONE;
+}
+
+/* *********************************************************************************** *
+ * @brief Place a foot, the joints are written to the servo frame (motion context)
+ *
+ * @retval 'false'  if the position is out of reach, the foot is placed as close as 
+ *                  possible
+ * *********************************************************************************** */
+bool setFoot(int leg, const foot_t *foot) {
+  fixangle_t hip, knee;
+  bool reachable = footAngles(leg, foot, &hip, &knee);
+  setHipRawFixed(leg, hip);
+  setKneeFixed(leg, knee);
+  return reachable;
+}
+
+/* *********************************************************************************** */
+/* @brief Change the geometry of a leg                                                 */
+/* *********************************************************************************** */
+bool setLegGeometry(int leg, const leggeometry_t *geometry) {
+  if (leg < 0 || leg >= NUM_LEGS || geometry->femur == 0 || geometry->kneeLevel > 180) {
+    return false;
+  }
+  LegGeometry[leg] = *geometry;
+  return true;
+}
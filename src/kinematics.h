@@ -0,0 +1,79 @@
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Fixed point leg kinematics                                                         */
+/*                                                                                     */
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Copyright 2024 by Bodo Bauer <bb@bb-zone.com>                                      */
+/*                                                                                     */
+/*  This program is free software: you can redistribute it and/or modify               */
+/*  it under the terms of the GNU General Public License as published by               */
+/*  the Free Software Foundation, either version 3 of the License, or                  */
+/*  (at your option) any later version.                                                */
+/*                                                                                     */
+/*  This program is distributed in the hope that it will be useful,                    */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of                     */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                      */
+/*  GNU General Public License for more details.                                       */
+/*                                                                                     */
+/*  You should have received a copy of the GNU General Public License                  */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.              */
+#include <Arduino.h>
+#include "legs.h"
+
+#ifndef KINEMATICS_H
+#define KINEMATICS_H
+
+/* *********************************************************************************** */
+/* Leg geometry (defaults)                                                             */
+/* *********************************************************************************** */
+
+// Body frame: x points forward (towards legs 0 and 5), y to the left, z up, the origin 
+// is the centre of the body at the height of the hip axes. All lengths in mm.
+#define LEG_MOUNT_FRONT_X    60   // hips of the front legs, the back legs are mirrored
+#define LEG_MOUNT_FRONT_Y    40
+#define LEG_MOUNT_MID_Y      50   // hips of the middle legs
+#define LEG_COXA             30   // hip axis to knee axis
+#define LEG_FEMUR            50   // knee axis to the tip of the foot
+#define LEG_KNEE_LEVEL       90   // knee angle at which the leg points straight out
+
+#define SINE_ONE          16384   // sine and cosine are scaled to this
+
+/* *********************************************************************************** */
+/* Custom Types                                                                        */
+/* *********************************************************************************** */
+
+typedef struct {                 // where a leg is mounted and how long it is
+  int16_t mountX;                // position of the hip axis in the body frame
+  int16_t mountY;
+  int16_t mountAngle;            // direction the leg points to with the hip at 90 degrees
+  uint8_t coxa;                  // hip axis to knee axis
+  uint8_t femur;                 // knee axis to the tip of the foot
+  uint8_t kneeLevel;             // knee angle at which the leg points straight out
+} leggeometry_t;
+
+typedef struct {                 // position of a foot in the body frame in mm
+  int16_t x;
+  int16_t y;
+  int16_t z;
+} foot_t;
+
+extern leggeometry_t LegGeometry[NUM_LEGS];
+
+/* *********************************************************************************** */
+/* Prototypes                                                                          */
+/* *********************************************************************************** */
+
+// fixed point trigonometry
+int        isin(fixangle_t a);                // sine scaled to SINE_ONE
+int        icos(fixangle_t a);
+fixangle_t iatan2(long y, long x);            // -180 to 180 degrees
+unsigned long isqrt(unsigned long n);
+
+// kinematics
+bool footAngles(int leg, const foot_t *foot, fixangle_t *hip, fixangle_t *knee);
+void footPosition(int leg, fixangle_t hip, fixangle_t knee, foot_t *foot);
+bool setFoot(int leg, const foot_t *foot);
+bool setLegGeometry(int leg, const leggeometry_t *geometry);
+
+#endif
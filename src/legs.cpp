@@ -31,106 +31,875 @@
 #include <Wire.h>
 #include <Adafruit_PWMServoDriver.h>
 #include "serial.h"
+#include "log.h"
+#include "blackbox.h"
+#include "persistence.h"
 #include "legs.h"
+#include "params.h"
 
 byte TrimInEffect    = 0;
-byte deferServoSet   = 0;
 bool ServosDetached  = true;
+byte ServoReleasePolicy = RELEASE_RAISED;
+unsigned long ServoChargeSaved = 0;   // estimated charge saved by released joints in mAs
+int  ServoCurrentBudget = SERVO_CURRENT_BUDGET;
+int  ServoSupplyMV   = SERVO_NOMINAL_MV;
+int  ServoFrequency  = SERVO_FREQ;
+int  ServoFrameMs    = 1000/SERVO_FREQ;    // a new position takes up to one frame to reach the servo
+unsigned int ServoWritten = 0;             // bit mask of the servos written while recording a frame
+unsigned long I2cTransactions = 0;         // transactions with the servo driver
+unsigned long I2cBytes        = 0;         // bytes on the bus including the address bytes
+
+#define I2C_PWM_BYTES 6                    // address, register and 4 bytes of on and off counts
+
+int  ServoPhaseStep  = SERVO_PHASE_STEP;   // PWM counts between the pulse starts of two channels
 
 typedef struct servo_t {
   byte           pin;
 
-  unsigned short ServoPos;     // the last commanded position of each servo
-  unsigned short ServoTarget;
+  unsigned short ServoPos;     // the last commanded position of each servo (fixed point angle)
+  unsigned short ServoRequest; // ServoPos with the body pose applied at the last commit that changed the frame
+  unsigned short ServoTarget;  // ServoRequest corrected for crashing hips
   long           ServoTime;    // the time that each servo was last commanded to a new position
   byte           ServoTrim;    // trim values for fine adjustments to servo horn positions
+  unsigned short ServoFrom;    // estimated position of the servo when it was last commanded
+  long           ServoTravel;  // predicted time in ms for the move from ServoFrom to ServoSent
+  unsigned short ServoSent;    // the last position actually sent to the servo driver
+  bool           ServoReleased;// the channel has been switched off to save energy
+  bool           ServoDirty;   // ServoPos written since the last commit, or held back by the current budget
 } servo_t;
 
+// All positions start unknown, so the servos are brought up staged by the current budget
+// the same way as after they have been detached (see forgetServoPositions()).
 servo_t Servo[NUM_SERVO] = {
-  {  0,  0,  0, 0L, 0   },  // Leg 0 - Hipp
-  {  1,  0,  0, 0L, 0   },  // Leg 1 - Hipp
-  {  2,  0,  0, 0L, 0   },  // Leg 2 - Hipp
-  {  3,  0,  0, 0L, 0   },  // Leg 3 - Hipp
-  {  4,  0,  0, 0L, 0   },  // Leg 4 - Hipp
-  {  5,  0,  0, 0L, 0   },  // Leg 5 - Hipp
-  {  8,  0,  0, 0L, 0   },  // Leg 0 - Knee
-  {  9,  0,  0, 0L, 0   },  // Leg 1 - Knee   
-  { 10,  0,  0, 0L, 0   },  // Leg 2 - Knee   
-  { 11,  0,  0, 0L, 0   },  // Leg 3 - Knee   
-  { 12,  0,  0, 0L, 0   },  // Leg 4 - Knee   
-  { 13,  0,  0, 0L, 0   },  // Leg 5 - Knee   
+  {  0,  0,  0,  0, 0L, 0, 0, 0L, SERVO_UNKNOWN, false, false },  // Leg 0 - Hipp
+  {  1,  0,  0,  0, 0L, 0, 0, 0L, SERVO_UNKNOWN, false, false },  // Leg 1 - Hipp
+  {  2,  0,  0,  0, 0L, 0, 0, 0L, SERVO_UNKNOWN, false, false },  // Leg 2 - Hipp
+  {  3,  0,  0,  0, 0L, 0, 0, 0L, SERVO_UNKNOWN, false, false },  // Leg 3 - Hipp
+  {  4,  0,  0,  0, 0L, 0, 0, 0L, SERVO_UNKNOWN, false, false },  // Leg 4 - Hipp
+  {  5,  0,  0,  0, 0L, 0, 0, 0L, SERVO_UNKNOWN, false, false },  // Leg 5 - Hipp
+  {  8,  0,  0,  0, 0L, 0, 0, 0L, SERVO_UNKNOWN, false, false },  // Leg 0 - Knee
+  {  9,  0,  0,  0, 0L, 0, 0, 0L, SERVO_UNKNOWN, false, false },  // Leg 1 - Knee   
+  { 10,  0,  0,  0, 0L, 0, 0, 0L, SERVO_UNKNOWN, false, false },  // Leg 2 - Knee   
+  { 11,  0,  0,  0, 0L, 0, 0, 0L, SERVO_UNKNOWN, false, false },  // Leg 3 - Knee   
+  { 12,  0,  0,  0, 0L, 0, 0, 0L, SERVO_UNKNOWN, false, false },  // Leg 4 - Knee   
+  { 13,  0,  0,  0, 0L, 0, 0, 0L, SERVO_UNKNOWN, false, false },  // Leg 5 - Knee   
 };
 
+const servoprofile_t hipProfile  = { HIP_PULSE_MIN,  HIP_PULSE_MAX,  0, SERVO_FREQ, SERVO_MS_PER_60DEG };
+const servoprofile_t kneeProfile = { KNEE_PULSE_MIN, KNEE_PULSE_MAX, 1, SERVO_FREQ, SERVO_MS_PER_60DEG };
+
+servoprofile_t ServoProfile[NUM_SERVO];
+unsigned short pwmLow[NUM_SERVO];         // PWM counts at 0 degrees
+unsigned short pwmHigh[NUM_SERVO];        // PWM counts at 180 degrees
+
+// The servo table is a double buffered frame: ServoPos is the back buffer all motion code
+// writes to, ServoSent the front buffer reflecting what has been sent to the servo driver.
+
 Adafruit_PWMServoDriver servoDriver = Adafruit_PWMServoDriver(SERVO_IIC_ADDR, Wire);
 
 void checkForCrashingHips(void);
+void forgetServoPositions(bool resend);
+void predictServoMove(int servonum, fixangle_t position);
+bool admitServoMove(int servonum, fixangle_t position);
+long servoMoveNeed(int servonum, fixangle_t position);
+fixangle_t servoEstimateAt(int servonum, unsigned long when);
+bool hipsCollide(fixangle_t pos, fixangle_t nextpos);
+void setHipFixed(int leg, fixangle_t pos, fixangle_t adj);
+fixangle_t posedPosition(int servonum);
 
 
-/* *********************************************************************************** */
-/* @brief Initialize Servos                                                            */
-/* *********************************************************************************** */
+/* *********************************************************************************** *
+ * @brief Initialize Servos
+ *
+ * The PCA9685 runs all channels at the same frame rate, so we use the highest rate all
+ * servos accept. The PWM counts for each servo are derived from its pulse range.
+ * *********************************************************************************** */
 void initServos(void) {
+  int freq = SERVO_FREQ_MAX;
+  for (int servo = 0; servo < NUM_SERVO; servo++) {
+    freq = min(freq, (int)ServoProfile[servo].max_freq);
+  }
+  ServoFrequency = freq;
+  ServoFrameMs   = (1000 + freq - 1) / freq;
+
+  for (int servo = 0; servo < NUM_SERVO; servo++) {
+    unsigned long low  = (ServoProfile[servo].pulse_min * (unsigned long)freq * 4096UL + 500000UL) / 1000000UL;
+    unsigned long high = (ServoProfile[servo].pulse_max * (unsigned long)freq * 4096UL + 500000UL) / 1000000UL;
+    pwmLow[servo]  = ServoProfile[servo].reversed ? high : low;
+    pwmHigh[servo] = ServoProfile[servo].reversed ? low  : high;
+  }
+
+  // stagger the pulse starts by up to SERVO_PHASE_STEP, as long as the longest pulse on 
+  // the last channel still ends within the 4096 counts of the frame
+  long longest = 0;
+  for (int servo = 0; servo < NUM_SERVO; servo++) {
+    longest = max(longest, (long)max(pwmLow[servo], pwmHigh[servo]));
+  }
+  ServoPhaseStep = constrain((4096L - longest) / (NUM_SERVO - 1), 0L, (long)SERVO_PHASE_STEP);
+
   servoDriver.begin();                              // Start Servo Controller board
   servoDriver.setOscillatorFrequency(OSC_FREQ);     
-  servoDriver.setPWMFreq(SERVO_FREQ);               // Analog servos run at ~50 Hz updates
+  servoDriver.setPWMFreq(ServoFrequency);
+}
+
+/* *********************************************************************************** *
+ * @brief Restart the servo driver on request of the motion task (loop context)
+ *
+ * Resetting the PCA9685 and changing its frame rate take delay(), which the motion task
+ * must not call. It sets ServoInitPending instead and leaves the servos alone until 
+ * loop() has restarted the driver, the servos are then brought back to their positions
+ * staged by the current budget.
+ * *********************************************************************************** */
+volatile bool ServoInitPending = false;
+
+void restartServoDriver(void) {
+  if (ServoInitPending) {
+    initServos();
+    forgetServoPositions(true);
+    ServoInitPending = false;
+  }
+}
+
+/* *********************************************************************************** *
+ * @brief Check if a servo profile makes sense
+ * *********************************************************************************** */
+bool servoProfileValid(const servoprofile_t *profile) {
+  return profile->pulse_min >= 400 && profile->pulse_max <= 3000 
+      && profile->pulse_min < profile->pulse_max
+      && profile->max_freq >= 40 && profile->max_freq <= SERVO_FREQ_MAX 
+      && profile->ms_per_60deg >= 20 && profile->ms_per_60deg <= 1000;
+}
+
+/* *********************************************************************************** *
+ * @brief Load servo profiles from the config store, use defaults for missing ones
+ *
+ * Needs to be called after loadFromEEPROM() and before initServos()
+ * *********************************************************************************** */
+void loadServoProfiles(void) {
+  servoconfig_t config;
+  memcpy(&config, persistentData.userdata + SERVO_CONFIG_OFFSET, sizeof(config));
+  bool valid = !strncmp(config.magic, SERVO_CONFIG_MAGIC, sizeof(config.magic));
+
+  for (int servo = 0; servo < NUM_SERVO; servo++) {
+    if (valid && servoProfileValid(&config.profile[servo])) {
+      ServoProfile[servo] = config.profile[servo];
+    } else {
+      ServoProfile[servo] = (servo < NUM_LEGS) ? hipProfile : kneeProfile;
+    }
+  }
+}
+
+/* *********************************************************************************** *
+ * @brief Save the current servo profiles to the config store
+ *
+ * The flash is written by loop() (see deferSaveToEEPROM()), the motion task must not 
+ * block on it.
+ * *********************************************************************************** */
+void saveServoProfiles(void) {
+  servoconfig_t config;
+  strncpy(config.magic, SERVO_CONFIG_MAGIC, sizeof(config.magic));
+  memcpy(config.profile, ServoProfile, sizeof(config.profile));
+  memcpy(persistentData.userdata + SERVO_CONFIG_OFFSET, &config, sizeof(config));
+  deferSaveToEEPROM();
+}
+
+/* *********************************************************************************** *
+ * @brief Replace the profile of a single servo
+ *
+ * The servo driver is restarted with the new settings by loop() (see 
+ * restartServoDriver()).
+ *
+ * @retval 'true'   if the profile has been applied,
+ *         'false'  if it has been rejected
+ * *********************************************************************************** */
+bool setServoProfile(int servonum, const servoprofile_t *profile) {
+  if (servonum < 0 || servonum >= NUM_SERVO || !servoProfileValid(profile)) {
+    return false;
+  }
+  ServoProfile[servonum] = *profile;
+  ServoInitPending = true;
+  return true;
+}
+
+/* *********************************************************************************** */
+/* @brief Calibrate the speed of all servos (ms per 60 degrees)                        */
+/* *********************************************************************************** */
+void setServoSpeed(int ms_per_60deg) {
+  for (int servo = 0; servo < NUM_SERVO; servo++) {
+    ServoProfile[servo].ms_per_60deg = constrain(ms_per_60deg, 20, 1000);
+  }
 }
 
 /* *********************************************************************************** */
-/* @brief Lowest level function for setting servo positions                   */
+/* @brief Lowest level function for setting servo positions in whole degrees           */
 /* *********************************************************************************** */
 void setServo(int servonum, unsigned int position) {
+  setServoFixed(servonum, ANGLE(constrain(position,0,180)));
+}
+
+/* *********************************************************************************** *
+ * @brief Lowest level function for setting servo positions in fixed point angles
+ *
+ * Positions are only written to the back buffer of the servo frame, nothing reaches the
+ * servos before the complete frame is committed (see commitServos()).
+ * *********************************************************************************** */
+void setServoFixed(int servonum, fixangle_t position) {
   servonum = constrain(servonum,0,15);
-  position = constrain(position,0,180);
+  position = constrain(position,0,ANGLE(180));
 
-  if (servonum < 12 ) { 
-    // shift both the hips and legs independently in cycles 6 long
-    int tmp = (servonum)%6; 
-    if (servonum>5) { // if it was a hip, make it still be a hip (the mod 6 above would have made it too low)
-      tmp += 6;   
-    }
-    servonum = constrain(tmp, 0, 11);
+  if (servonum >= NUM_SERVO) {
+    return;                             // channels 12-15 are not connected
   }
-  
-  if (position != Servo[servonum].ServoPos) {
-    Servo[servonum].ServoTime = millis();
+  // shift both the hips and legs independently in cycles 6 long
+  int tmp = (servonum)%6; 
+  if (servonum>5) { // if it was a hip, make it still be a hip (the mod 6 above would have made it too low)
+    tmp += 6;   
   }
-  Servo[servonum].ServoPos = position;  // keep data on where the servo was last commanded to go
+  servonum = constrain(tmp, 0, 11);
   
-  int p = 0; 
-  if (servonum<6) {                                    // hip
-    p = map(position,0,180,HIP_MIN,HIP_MAX);  
-  } else if ( servonum < 12 ) {                        // knee
-    p = map(position,180,0,KNEE_MIN,KNEE_MAX);
-  }
+  Servo[servonum].ServoPos   = position;  // keep data on where the servo was last commanded to go
+  Servo[servonum].ServoDirty = true;
+  ServoWritten |= (1 << servonum);
+}
+
+/* *********************************************************************************** */
+/* @brief Write the front buffer position of a servo to the servo driver               */
+/* *********************************************************************************** */
+void writeServo(int servonum) {
+  // direction and range from the servo profile
+  int p = map(Servo[servonum].ServoSent,0,ANGLE(180),pwmLow[servonum],pwmHigh[servonum]);
   
-  if (TrimInEffect && servonum < 12) {
+  if (TrimInEffect) {
     p += Servo[servonum].ServoTrim - TRIM_ZERO; // adjust microseconds by trim value which is renormalized to the range -127 to 128    
   }
 
   //sprintf(msg, "setServo(servonum: %d, position: %d ) => setPwm( pin: %d, on: 0, off: %d )", servonum, position, Servo[servonum].pin, p);
   //mqttSendMessage("/%s/Debug", msg );
 
-  if (!deferServoSet) {
-    servoDriver.setPWM(Servo[servonum].pin, 0, p);
-    ServosDetached = false;
+  // stagger the pulses so not all servos draw their peak current at the same time
+  int on = servonum * ServoPhaseStep;
+  servoDriver.setPWM(Servo[servonum].pin, on, (on + p) % 4096);
+  I2cTransactions++;
+  I2cBytes += I2C_PWM_BYTES;
+  ServosDetached = false;
+}
+
+/* *********************************************************************************** *
+ * @brief Move a servo from the back to the front buffer of the servo frame
+ *
+ * @param  budgeted  'true' if the current budget has already admitted the move
+ *
+ * @retval 'true'   if the servo is up to date,
+ *         'false'  if the move has been held back by the current budget
+ * *********************************************************************************** */
+bool sendServo(int servonum, bool budgeted) {
+  fixangle_t position = Servo[servonum].ServoTarget;
+
+  if (position != Servo[servonum].ServoSent) {
+    if (!(budgeted || admitServoMove(servonum, position)) || hipPathBlocked(servonum, position)) {
+      return false;                             // stays dirty, try again with the next commit
+    }
+    predictServoMove(servonum, position);
+    Servo[servonum].ServoSent     = position;
+    Servo[servonum].ServoReleased = false;      // a new target always re-attaches the joint
+    writeServo(servonum);
   }
+  Servo[servonum].ServoDirty = false;
+  return true;
+}
+
+/* *********************************************************************************** *
+ * @brief Estimate where a servo is right now
+ *
+ * Assumes the servo moves at constant speed from ServoFrom to ServoSent, starting one
+ * PWM frame after it was commanded.
+ * *********************************************************************************** */
+fixangle_t servoEstimate(int servonum) {
+  return servoEstimateAt(servonum, millis());
 }
 
 /* *********************************************************************************** */
-/* @brief Allow to set servo positions and delay actual movement                       */
+/* @brief Estimate where a servo is at the given time, assuming no new moves           */
 /* *********************************************************************************** */
-void transactServos() {
-  deferServoSet = 1;
+fixangle_t servoEstimateAt(int servonum, unsigned long when) {
+  if (Servo[servonum].ServoSent == SERVO_UNKNOWN) {
+    return Servo[servonum].ServoTarget;
+  }
+  long elapsed = (long)(when - Servo[servonum].ServoTime) - ServoFrameMs;
+  fixangle_t from = Servo[servonum].ServoFrom;
+  fixangle_t to   = Servo[servonum].ServoSent;
+
+  if (elapsed <= 0) {
+    return from;
+  }
+  if (elapsed >= Servo[servonum].ServoTravel) {
+    return to;
+  }
+  return from + ((to - from) * elapsed) / Servo[servonum].ServoTravel;
+}
+
+/* *********************************************************************************** *
+ * @brief Predict how long a servo takes to reach a new position
+ *
+ * The travel time is taken from the rated speed of the servo, scaled by the supply 
+ * voltage and by the load: knees pushing the body up and hips of legs standing on the
+ * ground are slower than legs swinging through the air.
+ * *********************************************************************************** */
+bool servoLoaded(int servonum, fixangle_t from, fixangle_t to) {
+  if (servonum < NUM_LEGS) {                                            // hip
+    return posedPosition(servonum+KNEE_OFFSET) <= ANGLE(SERVO_LOAD_KNEE);
+  }
+  return to < from && to <= ANGLE(SERVO_LOAD_KNEE);                     // knee
+}
+
+/* *********************************************************************************** *
+ * @brief Distance a servo has to travel to a new position (fixed point angle)
+ *
+ * The position of a servo that has been switched off is unknown, assume a long move.
+ * *********************************************************************************** */
+fixangle_t servoDistance(int servonum, fixangle_t position) {
+  if (Servo[servonum].ServoSent == SERVO_UNKNOWN) {
+    return ANGLE(SERVO_UNKNOWN_TRAVEL);
+  }
+  return abs(position - servoEstimate(servonum));
+}
+
+long servoMoveTime(int servonum, fixangle_t distance, bool loaded) {
+  long travel = ((long)distance * ServoProfile[servonum].ms_per_60deg) / ANGLE(60);
+  if (loaded) {
+    travel = (travel * SERVO_LOAD_FACTOR) / 100;
+  }
+  return (travel * SERVO_NOMINAL_MV) / ServoSupplyMV;
+}
+
+void predictServoMove(int servonum, fixangle_t position) {
+  fixangle_t from = servoEstimate(servonum);
+  long travel = servoMoveTime(servonum, servoDistance(servonum, position), 
+                              servoLoaded(servonum, from, position));
+
+  Servo[servonum].ServoFrom   = from;
+  Servo[servonum].ServoTravel = travel;
+  Servo[servonum].ServoTime   = millis();
+}
+
+/* *********************************************************************************** *
+ * @brief Time in ms until all servos are predicted to have completed the given 
+ *        percentage of their last commanded move (safety margin included)
+ * *********************************************************************************** */
+long servosRemaining(int percent) {
+  unsigned long now = millis();
+  long remaining = 0;
+
+  for (int servo = 0; servo < NUM_SERVO; servo++) {
+    if (Servo[servo].ServoDirty) {
+      remaining = max(remaining, 1L);         // not even started yet
+    }
+    unsigned long done = Servo[servo].ServoTime + ServoFrameMs 
+                       + (Servo[servo].ServoTravel * percent) / 100 + SERVO_SAFETY_MARGIN;
+    long left = (long)(done - now);
+    if (left > remaining) {
+      remaining = left;
+    }
+  }
+  return remaining;
+}
+
+/* *********************************************************************************** *
+ * @brief Estimated current a servo draws to reach a position
+ *
+ * Servos drive their motor at full power until they get close to the target, then the
+ * drive ramps down. Joints carrying the body need more power.
+ * *********************************************************************************** */
+long servoMoveCurrent(int servonum, fixangle_t from, fixangle_t to, fixangle_t distance) {
+  long current = ((long)SERVO_MOVE_MA * min(distance, ANGLE(SERVO_FULL_DRIVE_DEG))) / ANGLE(SERVO_FULL_DRIVE_DEG);
+  if (servoLoaded(servonum, from, to)) {
+    current = (current * SERVO_LOAD_FACTOR) / 100;
+  }
+  return max(current, (long)SERVO_HOLD_MA);
+}
+
+/* *********************************************************************************** *
+ * @brief Estimated current drawn by all servos right now
+ *
+ * @param  moving  set to 'true' if any servo is still on its way
+ * *********************************************************************************** */
+long servosCurrent(bool *moving) {
+  unsigned long now = millis();
+  long current = 0;
+
+  *moving = false;
+  for (int servo = 0; servo < NUM_SERVO; servo++) {
+    if (Servo[servo].ServoReleased || Servo[servo].ServoSent == SERVO_UNKNOWN) {
+      continue;                               // channel is switched off
+    }
+    if ((long)(now - Servo[servo].ServoTime) < ServoFrameMs + Servo[servo].ServoTravel) {
+      fixangle_t estimate = servoEstimate(servo);
+      fixangle_t to       = Servo[servo].ServoSent;
+      current += servoMoveCurrent(servo, estimate, to, abs(to - estimate));
+      *moving = true;
+    } else {
+      current += SERVO_HOLD_MA;
+    }
+  }
+  return current;
 }
 
 /* *********************************************************************************** */
-/* @brief Move all servos to designated position                                       */
+/* @brief Current a servo draws in addition to what it draws now when moving           */
 /* *********************************************************************************** */
+long servoMoveNeed(int servonum, fixangle_t position) {
+  fixangle_t from = servoEstimate(servonum);
+  long need = servoMoveCurrent(servonum, from, position, servoDistance(servonum, position));
+
+  if (!Servo[servonum].ServoReleased && Servo[servonum].ServoSent != SERVO_UNKNOWN) {
+    need -= SERVO_HOLD_MA;                     // this servo is already counted as holding
+  }
+  return need;
+}
+
+/* *********************************************************************************** *
+ * @brief Decide if a servo may start moving to a new position now
+ *
+ * A move is admitted if the estimated current of all servos stays within the 
+ * ServoCurrentBudget. If no servo is moving, a move is always admitted, so a single
+ * large move can not block forever.
+ * *********************************************************************************** */
+bool admitServoMove(int servonum, fixangle_t position) {
+  bool moving;
+  long current = servosCurrent(&moving);
+
+  return !moving || current + servoMoveNeed(servonum, position) <= ServoCurrentBudget;
+}
+
+/* *********************************************************************************** *
+ * @brief Admit the moves of neighbouring hips together
+ *
+ * The crash check validates a frame as a whole, so the current budget must not start 
+ * one hip of a pair and hold back the other. Hips with pending moves next to each other
+ * form a chain around the body, each chain is admitted or held back as a whole by the
+ * same rules as a single move (see admitServoMove()).
+ *
+ * @param  admitted  set for each hip whose move may start (or which has nothing to do)
+ * *********************************************************************************** */
+void admitHipMoves(bool *admitted) {
+  bool pending[NUM_LEGS];
+  int  first = 0;
+  bool moving;
+  long current = servosCurrent(&moving);
+
+  for (int leg = 0; leg < NUM_LEGS; leg++) {
+    pending[leg]  = Servo[leg].ServoDirty && Servo[leg].ServoTarget != Servo[leg].ServoSent;
+    admitted[leg] = !pending[leg];
+  }
+  // start at the beginning of a chain, if all hips are pending anywhere on the ring
+  for (int leg = 0; leg < NUM_LEGS; leg++) {
+    if (pending[leg] && !pending[(leg+NUM_LEGS-1) % NUM_LEGS]) {
+      first = leg;
+      break;
+    }
+  }
+  for (int i = 0; i < NUM_LEGS; ) {
+    int  count = 0;
+    long need  = 0;
+    while (i + count < NUM_LEGS && pending[(first+i+count) % NUM_LEGS]) {
+      int leg = (first+i+count) % NUM_LEGS;
+      need += servoMoveNeed(leg, Servo[leg].ServoTarget);
+      count++;
+    }
+    if (count > 0 && (!moving || current + need <= ServoCurrentBudget)) {
+      for (int j = 0; j < count; j++) {
+        admitted[(first+i+j) % NUM_LEGS] = true;
+      }
+      current += need;                         // the chains admitted so far start moving
+      moving   = true;
+    }
+    i += max(count, 1);
+  }
+}
+
+/* *********************************************************************************** *
+ * @brief Forget where the servos are after their channels have been switched off
+ *
+ * @param  resend  'true' to bring the servos back to their last position, staged by 
+ *                 the current budget
+ * *********************************************************************************** */
+void forgetServoPositions(bool resend) {
+  for (int servo = 0; servo < NUM_SERVO; servo++) {
+    Servo[servo].ServoDirty    = resend && !Servo[servo].ServoReleased 
+                                        && Servo[servo].ServoSent != SERVO_UNKNOWN;
+    Servo[servo].ServoSent     = SERVO_UNKNOWN;
+    Servo[servo].ServoReleased = false;
+  }
+}
+
+/* *********************************************************************************** *
+ * @brief Release joints which do not need holding torque
+ *
+ * Needs to be called once per loop. A joint is released once it has reached its 
+ * position and rested there for SERVO_RELEASE_DELAY. Which joints qualify depends on
+ * the ServoReleasePolicy:
+ *
+ *   RELEASE_RAISED     hip and knee of legs lifted off the ground, e.g. the middle legs
+ *                      during the quad gait
+ *   RELEASE_IDLE_HIPS  additionally the hips of legs standing on the ground, e.g. the
+ *                      five resting legs during the ripple gait. The knees keep carrying
+ *                      the body, friction on the ground keeps the hips in place.
+ *
+ * The next new target for a released joint switches its channel back on (see setServo()).
+ * *********************************************************************************** */
+void releaseIdleJoints(void) {
+  static unsigned long lastUpdate = 0;
+  unsigned long now = millis();
+
+  if (ServoReleasePolicy != RELEASE_NONE) {
+    for (int leg = 0; leg < NUM_LEGS; leg++) {
+      int  knee   = leg + KNEE_OFFSET;
+      bool raised = Servo[knee].ServoSent != SERVO_UNKNOWN && Servo[knee].ServoSent >= ANGLE(SERVO_RELEASE_KNEE);
+
+      for (int servo = leg; servo <= knee; servo += KNEE_OFFSET) {
+        if (Servo[servo].ServoSent == SERVO_UNKNOWN || Servo[servo].ServoDirty) {
+          continue;
+        }
+        bool idle = (long)(now - Servo[servo].ServoTime) 
+                  >= ServoFrameMs + Servo[servo].ServoTravel + SERVO_RELEASE_DELAY;
+        bool unloaded = raised || (servo < NUM_LEGS && ServoReleasePolicy == RELEASE_IDLE_HIPS);
+
+        if (idle && unloaded && !Servo[servo].ServoReleased && !ServosDetached) {
+          servoDriver.setPin(Servo[servo].pin, 0, false);  // stop pulses, the servo goes limp
+          I2cTransactions++;
+          I2cBytes += I2C_PWM_BYTES;
+          Servo[servo].ServoReleased = true;
+        }
+      }
+    }
+  }
+
+  // keep track of the energy saved
+  static unsigned long residue = 0;                      // mA*ms not yet accounted in mAs
+  if (!ServosDetached) {
+    residue += (unsigned long)servosReleased() * SERVO_HOLD_MA * (now - lastUpdate);
+    ServoChargeSaved += residue / 1000;
+    residue %= 1000;
+  }
+  lastUpdate = now;
+}
+
+/* *********************************************************************************** *
+ * @brief Switch all released joints back on
+ * *********************************************************************************** */
+void attachReleasedJoints(void) {
+  for (int servo = 0; servo < NUM_SERVO; servo++) {
+    if (Servo[servo].ServoReleased) {
+      Servo[servo].ServoReleased = false;
+      writeServo(servo);
+    }
+  }
+}
+
+/* *********************************************************************************** *
+ * @brief Number of joints currently released
+ * *********************************************************************************** */
+int servosReleased(void) {
+  int count = 0;
+  for (int servo = 0; servo < NUM_SERVO; servo++) {
+    if (Servo[servo].ServoReleased) {
+      count++;
+    }
+  }
+  return count;
+}
+
+/* *********************************************************************************** *
+ * @brief Determine the current phase of a gait
+ *
+ * A gait advances to the next phase as soon as all servos are predicted to have 
+ * reached the positions commanded in the current phase. The share of the time period
+ * given to a phase (see setPhaseTiming()) is the longest it may take. At the end of the
+ * cycle the gait holds while new gait parameters are waiting (see gaitCycleBoundary()).
+ * *********************************************************************************** */
+long gaitPhase(gaitphase_t *gp, const phasetiming_t *timing, long timeperiod) {
+  if ( (long)(hexmillis() - gp->started) >= phaseSlot(timing, gp->phase, timeperiod) || servosRemaining(100) == 0 ) {
+    if (gp->phase == timing->count-1 && gaitCycleBoundary()) {
+      return gp->phase;                     // hold until the new gait parameters are applied
+    }
+    gp->phase   = (gp->phase + 1) % timing->count;
+    gp->started = hexmillis();
+  }
+  return gp->phase;
+}
+
+/* *********************************************************************************** *
+ * @brief Phase timing
+ *
+ * Knee phases move less and mostly unloaded joints, so they need less time than the 
+ * phases moving the body at the hips. Each kind of phase (PHASE_LIFT, ...) has a weight,
+ * the share of a phase in the cycle time is its weight over the sum of the weights of
+ * all phases of the cycle. The prefix sums of the weights are kept, so the time slot of
+ * a phase is the difference of two of them.
+ *
+ * Weights configured as 0 are derived from the servo speed model: the predicted time 
+ * for the joint travel of the phase, with the same frame and safety margins as 
+ * servosRemaining().
+ * *********************************************************************************** */
+void phaseWeights(long weight[NUM_PHASE_KINDS], const int16_t configured[NUM_PHASE_KINDS], int kneetravel, int hiptravel) {
+  long margin = ServoFrameMs + SERVO_SAFETY_MARGIN;
+  fixangle_t knee = ANGLE(abs(kneetravel));
+  fixangle_t hip  = ANGLE(abs(hiptravel));
+
+  weight[PHASE_LIFT]  = servoMoveTime(KNEE_OFFSET, knee, false) + margin;
+  weight[PHASE_SWING] = servoMoveTime(0, hip, false) + margin;
+  weight[PHASE_LOWER] = servoMoveTime(KNEE_OFFSET, knee, true) + margin;
+  weight[PHASE_PUSH]  = servoMoveTime(0, hip, true) + margin;
+  for (int kind = 0; kind < NUM_PHASE_KINDS; kind++) {
+    if (configured[kind] > 0) {
+      weight[kind] = configured[kind];
+    }
+  }
+}
+
+/* *********************************************************************************** */
+/* @brief Build the prefix sums for a cycle made up of the given kinds of phases       */
+/* *********************************************************************************** */
+void setPhaseTiming(phasetiming_t *timing, const byte *kinds, int count, const long weight[NUM_PHASE_KINDS]) {
+  count = min(count, MAX_GAIT_PHASES);
+  timing->count     = count;
+  timing->prefix[0] = 0;
+  for (int phase = 0; phase < count; phase++) {
+    timing->prefix[phase+1] = timing->prefix[phase] + max(weight[kinds[phase]], 1L);
+  }
+}
+
+/* *********************************************************************************** */
+/* @brief Longest time a phase may take                                                */
+/* *********************************************************************************** */
+long phaseSlot(const phasetiming_t *timing, int phase, long timeperiod) {
+  return (timeperiod * (long)(timing->prefix[phase+1] - timing->prefix[phase])) / (long)timing->prefix[timing->count];
+}
+
+/* *********************************************************************************** *
+ * @brief Frame cache
+ *
+ * Within a gait phase the gaits compute the very same frame on every loop. The frames 
+ * are therefore cached by mode, submode, command and phase: the gait calls 
+ * frameCached() once it knows its phase and only runs its setLeg() sequence on a miss,
+ * followed by cacheFrame(). Only the servos actually written by the gait are part of a
+ * frame, so legs left alone (NOMOVE) keep their positions as before. The least 
+ * recently used frame is replaced when the cache is full.
+ * *********************************************************************************** */
+typedef struct {
+  unsigned long  key;                  // mode, submode, command and phase, 0 if unused
+  unsigned long  used;                 // FrameCacheHits+FrameCacheMisses at the last use
+  unsigned int   mask;                 // servos written by the gait in this phase
+  unsigned short pos[NUM_SERVO];       // the positions written (fixed point angles)
+} frame_t;
+
+frame_t FrameCache[FRAME_CACHE_SIZE];
+unsigned long FrameCacheHits   = 0;
+unsigned long FrameCacheMisses = 0;
+unsigned long FrameContext     = 0;    // mode, submode and command of the running gait
+unsigned long FrameRecording   = 0;    // key of the frame being recorded, 0 if none
+byte          GaitPhase        = 0;    // phase the running gait asked for last (telemetry)
+
+#define FRAME_KEY(phase) (FrameContext | ((phase) & 0xFF))
+
+/* *********************************************************************************** */
+/* @brief Set mode, submode and command the following gait frames belong to            */
+/* *********************************************************************************** */
+void frameContext(byte mode, byte submode, byte command) {
+  FrameContext = ((unsigned long)mode << 24) | ((unsigned long)submode << 16) | ((unsigned long)command << 8);
+}
+
+/* *********************************************************************************** *
+ * @brief Replay the cached frame of a gait phase
+ *
+ * Returns true if the frame was found and has been written to the back buffer. 
+ * Otherwise recording starts and the gait has to compute the frame and hand it to 
+ * cacheFrame(). As every gait calls this once per run, the phase is kept in GaitPhase
+ * for telemetry.
+ * *********************************************************************************** */
+bool frameCached(long phase) {
+  unsigned long key = FRAME_KEY(phase);
+  GaitPhase = phase;
+
+  for (int i = 0; i < FRAME_CACHE_SIZE; i++) {
+    if (FrameCache[i].key == key) {
+      for (int servo = 0; servo < NUM_SERVO; servo++) {
+        if (FrameCache[i].mask & (1 << servo)) {
+          Servo[servo].ServoPos   = FrameCache[i].pos[servo];
+          Servo[servo].ServoDirty = true;
+        }
+      }
+      FrameCacheHits++;
+      FrameCache[i].used = FrameCacheHits + FrameCacheMisses;
+      FrameRecording = 0;
+      return true;
+    }
+  }
+  FrameCacheMisses++;
+  FrameRecording = key;
+  ServoWritten   = 0;
+  return false;
+}
+
+/* *********************************************************************************** */
+/* @brief Keep the frame the gait just computed for the given phase                    */
+/* *********************************************************************************** */
+void cacheFrame(long phase) {
+  unsigned long key = FRAME_KEY(phase);
+  if (FrameRecording != key) {
+    return;                             // frameCached() was not asked for this phase
+  }
+  FrameRecording = 0;
+
+  int slot = 0;
+  for (int i = 1; i < FRAME_CACHE_SIZE; i++) {
+    if (FrameCache[i].used < FrameCache[slot].used) {
+      slot = i;
+    }
+  }
+  FrameCache[slot].key  = key;
+  FrameCache[slot].used = FrameCacheHits + FrameCacheMisses;
+  FrameCache[slot].mask = ServoWritten;
+  for (int servo = 0; servo < NUM_SERVO; servo++) {
+    FrameCache[slot].pos[servo] = Servo[servo].ServoPos;
+  }
+}
+
+/* *********************************************************************************** */
+/* @brief Drop all cached frames, needed whenever the gait geometry changes            */
+/* *********************************************************************************** */
+void invalidateFrames(void) {
+  for (int i = 0; i < FRAME_CACHE_SIZE; i++) {
+    FrameCache[i].key  = 0;
+    FrameCache[i].used = 0;
+  }
+  FrameRecording = 0;
+}
+
+/* *********************************************************************************** *
+ * @brief Body pose
+ *
+ * Height, roll and pitch of the body are offsets added to the positions of the gaits
+ * when the frame is sent to the servos, so a new pose applies to the running gait right
+ * away and the cached frames stay valid. The offsets of each joint are taken from a 
+ * compensation table giving the share (in percent) of height, roll and pitch the joint 
+ * contributes. Bending a knee up lowers the body on that corner, the hips shift the 
+ * feet so that the support polygon stays under the centre of mass when pitching.
+ * Positive values raise the body, roll it to the left and pitch the nose down.
+ * *********************************************************************************** */
+typedef struct {
+  signed char height;                  // percent of the body height
+  signed char roll;                    // percent of the roll angle
+  signed char pitch;                   // percent of the pitch angle
+} posecomp_t;
+
+const posecomp_t PoseComp[NUM_SERVO] = {
+  {    0,    0,  -25 },  // Leg 0 - Hip   (front right)
+  {    0,    0,  -25 },  // Leg 1 - Hip   (middle right)
+  {    0,    0,  -25 },  // Leg 2 - Hip   (back right)
+  {    0,    0,   25 },  // Leg 3 - Hip   (back left, mirrored)
+  {    0,    0,   25 },  // Leg 4 - Hip   (middle left, mirrored)
+  {    0,    0,   25 },  // Leg 5 - Hip   (front left, mirrored)
+  { -100, -100,  100 },  // Leg 0 - Knee  (front right)
+  { -100, -100,    0 },  // Leg 1 - Knee  (middle right)
+  { -100, -100, -100 },  // Leg 2 - Knee  (back right)
+  { -100,  100, -100 },  // Leg 3 - Knee  (back left)
+  { -100,  100,    0 },  // Leg 4 - Knee  (middle left)
+  { -100,  100,  100 },  // Leg 5 - Knee  (front left)
+};
+
+int PoseHeight = 0;                    // degrees, see setPose()
+int PoseRoll   = 0;
+int PosePitch  = 0;
+fixangle_t PoseOffset[NUM_SERVO];      // offset of each joint for the current pose
+
+/* *********************************************************************************** *
+ * @brief Set the body pose, takes effect with the next commit
+ * *********************************************************************************** */
+void setPose(int height, int roll, int pitch) {
+  PoseHeight = constrain(height, -POSE_HEIGHT_MAX, POSE_HEIGHT_MAX);
+  PoseRoll   = constrain(roll,   -POSE_ROLL_MAX,   POSE_ROLL_MAX);
+  PosePitch  = constrain(pitch,  -POSE_PITCH_MAX,  POSE_PITCH_MAX);
+
+  for (int servo = 0; servo < NUM_SERVO; servo++) {
+    long offset = (long)PoseComp[servo].height * PoseHeight
+                + (long)PoseComp[servo].roll   * PoseRoll
+                + (long)PoseComp[servo].pitch  * PosePitch;
+    PoseOffset[servo] = (ANGLE(offset)) / 100;
+
+    // resend joints which hold a position, released joints follow with their next move
+    if (Servo[servo].ServoSent != SERVO_UNKNOWN && !Servo[servo].ServoReleased) {
+      Servo[servo].ServoDirty = true;
+    }
+  }
+}
+
+/* *********************************************************************************** */
+/* @brief Position of a servo in the back buffer with the body pose applied            */
+/* *********************************************************************************** */
+fixangle_t posedPosition(int servonum) {
+  if (PoseOffset[servonum] == 0) {
+    return Servo[servonum].ServoPos;
+  }
+  return constrain((fixangle_t)Servo[servonum].ServoPos + PoseOffset[servonum], 0, ANGLE(180));
+}
+
+/* *********************************************************************************** */
+/* @brief Position last sent to a servo, SERVO_UNKNOWN if its channel is switched off  */
+/* *********************************************************************************** */
+unsigned short servoPosition(int servonum) {
+  return Servo[servonum].ServoSent;
+}
+
+/* *********************************************************************************** *
+ * @brief Commit the servo frame
+ *
+ * Motion code only writes to the back buffer (ServoPos). Once the frame is complete, the
+ * body pose is applied, the crash check runs on the resulting targets and all changed 
+ * positions are sent to the servo driver. If the frame equals the one requested by the
+ * last commit, e.g. a frame replayed from the frame cache, the targets corrected back 
+ * then still apply and the crash check is skipped. Moves held back by the current 
+ * budget stay dirty and are retried with the next commit, so this needs to be called
+ * at least once per loop. Neighbouring hips are admitted together (see admitHipMoves()),
+ * hips held back for any other reason are protected by hipPathBlocked(). A frame is recorded in the black box whenever a servo has 
+ * been sent a new position.
+ * *********************************************************************************** */
 void commitServos() {
-  checkForCrashingHips();
-  deferServoSet = 0;
-  for (int servo = 0; servo < 2*NUM_LEGS; servo++) {
-    setServo(servo, Servo[servo].ServoPos);
+  bool changed = false;
+  for (int servo = 0; servo < NUM_SERVO; servo++) {
+    if (Servo[servo].ServoDirty && posedPosition(servo) != Servo[servo].ServoRequest) {
+      changed = true;
+    }
+  }
+
+  if (changed) {
+    unsigned short previous[NUM_SERVO];
+    for (int servo = 0; servo < NUM_SERVO; servo++) {
+      previous[servo] = Servo[servo].ServoTarget;
+      Servo[servo].ServoRequest = posedPosition(servo);
+      Servo[servo].ServoTarget  = Servo[servo].ServoRequest;
+    }
+    checkForCrashingHips();
+    for (int servo = 0; servo < NUM_SERVO; servo++) {
+      if (Servo[servo].ServoTarget != previous[servo]) {
+        Servo[servo].ServoDirty = true;      // e.g. a correction of the last frame no longer needed
+      }
+    }
+  }
+
+  bool admitted[NUM_LEGS];
+  admitHipMoves(admitted);
+
+  bool sent = false;
+  for (int servo = 0; servo < NUM_SERVO; servo++) {
+    if (Servo[servo].ServoDirty && (servo >= NUM_LEGS || admitted[servo])) {
+      unsigned short before = Servo[servo].ServoSent;
+      sendServo(servo, servo < NUM_LEGS);
+      sent |= (Servo[servo].ServoSent != before);
+    }
+  }
+  if (sent) {
+    blackboxFrame(GaitPhase);
   }
 }
 /* *********************************************************************************** */
@@ -155,12 +924,25 @@ void setLeg(int legmask, int hip_pos, int knee_pos, int adj, int raw) {
   setLeg(legmask, hip_pos, knee_pos, adj, raw, 0);
 }
 
+/* *********************************************************************************** */
+/* @brief sets the positions of both the knee and hip in whole degrees                 */
+/* *********************************************************************************** */
+void setLeg(int legmask, int hip_pos, int knee_pos, int adj, int raw, int leanangle) {
+  setLegFixed(legmask, (hip_pos  == NOMOVE) ? NOMOVE : ANGLE(hip_pos), 
+                       (knee_pos == NOMOVE) ? NOMOVE : ANGLE(knee_pos), 
+                       ANGLE(adj), raw, ANGLE(leanangle));
+}
+
 /* *********************************************************************************** */
 /* @brief This version of setHip does no processing at all (for example to distinguish */
 /*        left from right sides)                                                       */
 /* *********************************************************************************** */
 void setHipRaw(int leg, int pos) {
-  setServo(leg, pos);
+  setHipRawFixed(leg, ANGLE(pos));
+}
+
+void setHipRawFixed(int leg, fixangle_t pos) {
+  setServoFixed(leg, pos);
 }
 
 /* *********************************************************************************** */
@@ -169,11 +951,15 @@ void setHipRaw(int leg, int pos) {
 /*         robot                                                                       */
 /* *********************************************************************************** */
 void setHip(int leg, int pos) {
+  setHipFixed(leg, ANGLE(pos));
+}
+
+void setHipFixed(int leg, fixangle_t pos) {
   // reverse the left side for consistent forward motion
   if (leg >= LEFT_START) {
-    pos = 180 - pos;
+    pos = ANGLE(180) - pos;
   }
-  setHipRaw(leg, pos);
+  setHipRawFixed(leg, pos);
 }
 
 /* *********************************************************************************** */
@@ -181,7 +967,7 @@ void setHip(int leg, int pos) {
 /*        the front legs a little back and the back legs forward to make a better      */
 /*        balance for certain gaits like tripod or quadruped                           */
 /* *********************************************************************************** */
-void setHip(int leg, int pos, int adj) {
+void setHipFixed(int leg, fixangle_t pos, fixangle_t adj) {
   if (ISFRONTLEG(leg)) {
     pos -= adj;
   } else if (ISBACKLEG(leg)) {
@@ -189,9 +975,9 @@ void setHip(int leg, int pos, int adj) {
   }
   // reverse the left side for consistent forward motion
   if (leg >= LEFT_START) {
-    pos = 180 - pos;
+    pos = ANGLE(180) - pos;
   }
-  setHipRaw(leg, pos);
+  setHipRawFixed(leg, pos);
 }
 
 /* *********************************************************************************** */
@@ -199,42 +985,50 @@ void setHip(int leg, int pos, int adj) {
 /*        the adjust parameter to shift the front/back legs                            */
 /* *********************************************************************************** */
 void setHipRawAdj(int leg, int pos, int adj) {
+  setHipRawAdjFixed(leg, ANGLE(pos), ANGLE(adj));
+}
+
+void setHipRawAdjFixed(int leg, fixangle_t pos, fixangle_t adj) {
   if (leg == 5 || leg == 2) {
     pos += adj;
   } else if (leg == 0 || leg == 3) {
     pos -= adj;
   }
 
-  setHipRaw(leg, pos);
+  setHipRawFixed(leg, pos);
 }
 
 /* *********************************************************************************** */
 /* @brief Set knee position                                                            */ 
 /* *********************************************************************************** */
 void setKnee(int leg, int pos) {
+  setKneeFixed(leg, ANGLE(pos));
+}
+
+void setKneeFixed(int leg, fixangle_t pos) {
   // find the knee associated with leg if this is not already a knee
   if (leg < KNEE_OFFSET) {
     leg += KNEE_OFFSET;
   }
-  setServo(leg, pos);
+  setServoFixed(leg, pos);
 }
 
 /* *********************************************************************************** */
-/* @brief sets the positions of both the knee and hip in a single command              */
+/* @brief sets the positions of both the knee and hip in fixed point angles            */
 /* *********************************************************************************** */
-void setLeg(int legmask, int hip_pos, int knee_pos, int adj, int raw, int leanangle) {
+void setLegFixed(int legmask, fixangle_t hip_pos, fixangle_t knee_pos, fixangle_t adj, int raw, fixangle_t leanangle) {
   for (int i = 0; i < NUM_LEGS; i++) {
     if (legmask & 0b1) {  // if the lowest bit is ON then we are moving this leg
       if (hip_pos != NOMOVE) {
         if (!raw) {
-          setHip(i, hip_pos, adj);
+          setHipFixed(i, hip_pos, adj);
         } else {
-          setHipRaw(i, hip_pos);
+          setHipRawFixed(i, hip_pos);
         }
       }
 
       if (knee_pos != NOMOVE) {
-        int pos = knee_pos;
+        fixangle_t pos = knee_pos;
         if (leanangle != 0) {
           switch (i) {
             case 0: case 6: case 5: case 11:
@@ -248,7 +1042,7 @@ void setLeg(int legmask, int hip_pos, int knee_pos, int adj, int raw, int leanan
               break;
           }
         }
-        setKnee(i, pos);
+        setKneeFixed(i, pos);
       }
     }
     legmask = (legmask>>1);  // shift down one bit position to check the next legmask bit
@@ -266,36 +1060,92 @@ void setLeg(int legmask, int hip_pos, int knee_pos, int adj, int raw, int leanan
  * situations. Very minor stalls (where the motor is commanded a few degress farther
  * than it can physically go) may still occur, but those won't draw much power (the
  * current draw is proportional to how far off the mark the servo is).
+ *
+ * The check runs on the targets of the commit (ServoTarget), i.e. with the body pose 
+ * applied, the back buffer written by the gaits stays untouched.
  * *********************************************************************************** */
 void checkForCrashingHips(void) {
   for (int leg = 0; leg < NUM_LEGS; leg++) {
-    if (Servo[leg].ServoPos > 85) {
-      continue; // it's not possible to crash into the next leg in line unless the angle is 85 or less
-    }
     int nextleg = ((leg+1)%NUM_LEGS);
-    if (Servo[nextleg].ServoPos < 100) {
-      continue;   // it's not possible for there to be a crash if the next leg is less than 100 degrees
-                  // there is a slight assymmetry due to the way the servo shafts are positioned, that's why
-                  // this number does not match the 85 number above
-    }
-    int diff = Servo[nextleg].ServoPos - Servo[leg].ServoPos;
-    // There's a fairly linear relationship
-    if (diff <= 85) {
-      // if the difference between the two leg positions is less than about 85 then there
-      // is not going to be a crash (or maybe just a slight touch that won't really cause issues)
+    if (!hipsCollide(Servo[leg].ServoTarget, Servo[nextleg].ServoTarget)) {
       continue;
     }
     // if we get here then the legs are touching, we will adjust them so that the difference is less than 85
-    int adjust = (diff-85)/2 + 1;  // each leg will get adjusted half the amount needed to avoid the crash
+    fixangle_t diff   = Servo[nextleg].ServoTarget - Servo[leg].ServoTarget;
+    fixangle_t adjust = (diff-ANGLE(HIP_CRASH_DIFF))/2 + ANGLE(1);  // each leg will get adjusted half the amount needed to avoid the crash
     
-    // to debug crash detection, make the following line #if 1, else make it #if 0
-    PRINT("#CRASH:");
-    PRINT(leg);PRINT("="); PRINT(Servo[leg].ServoPos);
-    PRINT("/");PRINT(nextleg);PRINT("="); PRINT(Servo[nextleg].ServoPos);
-    PRINT(" Diff=");PRINT(diff); PRINT(" ADJ=");PRINTLN(adjust);
+    // to debug crash detection, build with LOG_LEVEL set to LOG_LEVEL_INFO or below
+    LOG_INFO(LOG_CRASH, leg, Servo[leg].ServoTarget, nextleg, Servo[nextleg].ServoTarget, adjust);
+
+    Servo[leg].ServoTarget     += adjust;
+    Servo[nextleg].ServoTarget -= adjust;
+    Servo[leg].ServoDirty       = true;
+    Servo[nextleg].ServoDirty   = true;
+  }
+}
 
-    setServo(leg, Servo[leg].ServoPos + adjust);   
-    setServo(nextleg, Servo[nextleg].ServoPos - adjust);
+/* *********************************************************************************** *
+ * @brief Check if a hip and the next one in line are in each others way
+ * *********************************************************************************** */
+bool hipsCollide(fixangle_t pos, fixangle_t nextpos) {
+  if (pos > ANGLE(HIP_CRASH_LOW)) {
+    return false; // it's not possible to crash into the next leg in line unless the angle is 85 or less
+  }
+  if (nextpos < ANGLE(HIP_CRASH_HIGH)) {
+    return false; // it's not possible for there to be a crash if the next leg is less than 100 degrees
+                  // there is a slight assymmetry due to the way the servo shafts are positioned, that's why
+                  // this number does not match the 85 number above
+  }
+  // There's a fairly linear relationship, if the difference between the two leg positions 
+  // is less than about 85 then there is not going to be a crash (or maybe just a slight 
+  // touch that won't really cause issues)
+  return nextpos - pos > ANGLE(HIP_CRASH_DIFF);
+}
+
+/* *********************************************************************************** *
+ * @brief Check the path of a hip move against the moves of the neighbouring hips
+ *
+ * checkForCrashingHips() only sees the end positions of a frame. Hips moving towards 
+ * each other from opposite sides can still meet half way, and a neighbour whose move
+ * has been held back is not where the frame expects it. The new move is followed along
+ * the servo speed model in steps of HIP_SWEEP_STEP_MS against the estimated positions 
+ * of both neighbours, moving or not. If they would meet, the move is held back like a
+ * move exceeding the current budget: the neighbour gets out of the way first and the 
+ * move is retried with the next commit. Independent of the path, the servo driver never
+ * gets a hip position crashing with the position last sent to a neighbour, e.g. while 
+ * the neighbour's move to get out of the way is still held back.
+ *
+ * @retval 'true'   if the move has to wait
+ * *********************************************************************************** */
+unsigned long HipMovesHeld = 0;          // hip moves held back to avoid a collision on the way
+
+bool hipPathBlocked(int servonum, fixangle_t position) {
+  if (servonum >= NUM_LEGS || Servo[servonum].ServoSent == SERVO_UNKNOWN) {
+    return false;                        // knees can't collide, unknown positions can't be followed
+  }
+  int prevleg = (servonum+NUM_LEGS-1) % NUM_LEGS;
+  int nextleg = (servonum+1) % NUM_LEGS;
+  unsigned long start = millis() + ServoFrameMs;
+
+  if ((Servo[prevleg].ServoSent != SERVO_UNKNOWN && hipsCollide(Servo[prevleg].ServoSent, position)) ||
+      (Servo[nextleg].ServoSent != SERVO_UNKNOWN && hipsCollide(position, Servo[nextleg].ServoSent))) {
+    HipMovesHeld++;
+    return true;
+  }
+
+  fixangle_t from = servoEstimate(servonum);
+  long travel = servoMoveTime(servonum, abs(position - from), servoLoaded(servonum, from, position));
+
+  for (long t = 0; ; t = min(t + HIP_SWEEP_STEP_MS, travel)) {
+    fixangle_t pos = (travel > 0) ? from + ((position - from) * t) / travel : position;
+    if (hipsCollide(servoEstimateAt(prevleg, start + t), pos) || 
+        hipsCollide(pos, servoEstimateAt(nextleg, start + t))) {
+      HipMovesHeld++;
+      return true;
+    }
+    if (t >= travel) {
+      return false;
+    }
   }
 }
 
@@ -315,6 +1165,7 @@ void checkForCrashingHips(void) {
 
 unsigned long freqWatchDog = 0;
 unsigned long SuppressScamperUntil = 0;  // if we had to wake up the servos, suppress the power hunger scamper mode for a while
+unsigned long ServoSleepRecoveries = 0;  // how often the servo driver had to be woken up
 
 void checkForServoSleep(void) {
   if (millis() > freqWatchDog) { // do NOT use hexmillis here, we want real time
@@ -325,9 +1176,14 @@ void checkForServoSleep(void) {
     Wire.endTransmission();
     Wire.requestFrom((uint8_t)SERVO_IIC_ADDR, (uint8_t)1);
     int mode1 = Wire.read();
+    I2cTransactions += 2;
+    I2cBytes        += 4;       // address and register, address and MODE1
     if (mode1 & 16) { // the fifth bit up from the bottom is 1 if controller was asleep
-      // wake it up!
-      initServos();
+      // have loop() wake it up, the driver lost all pulses, the servos are brought back one by one
+      ServoInitPending = true;
+      ServoSleepRecoveries++;
+      LOG_WARN(LOG_SERVO_SLEEP, ServoSleepRecoveries);
+      blackboxServoSleep(ServoSleepRecoveries);
       SuppressScamperUntil = millis() + 10000;  // no scamper for you! (for 10 seconds because we ran out of power, give the battery
                                                 // a bit of time for charge migration and let the servos cool down). Don't use hexmillis here.
     }
@@ -342,6 +1198,10 @@ void detachAllServos() {
   //Serial.println("DETACH");
   for (int i = 0; i < 16; i++) {
     servoDriver.setPin(i,0,false); // stop pulses which will quickly detach the servo
+    I2cTransactions++;
+    I2cBytes += I2C_PWM_BYTES;
   }
+  forgetServoPositions(false);     // the next moves re-attach the servos staged by the current budget
   ServosDetached = true;
+  LOG_INFO(LOG_DETACH);
 }
\ No newline at end of file
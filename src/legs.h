@@ -40,25 +40,106 @@
 
 #define SERVO_CENTER      ((SERVO_MAX-SERVO_MIN)/2 + SERVO_MIN)
 #define SERVO_FREQ         50  // Analog servos run at ~50 Hz updates
+#define SERVO_FREQ_MAX    300  // fastest frame rate we drive even digital servos with
 #define OSC_FREQ     26062360  // calculated oscillator frequency
 #define NUM_SERVO          12  // 6 Legs by 2 Joints -> 12 Servos
 #define NUM_LEGS            6  // 6 legs
 #define TRIM_ZERO           0  // this value is the midpoint of the trim range (a byte)
 #define TIMEFACTOR         10L
 #define SERVO_IIC_ADDR  (0x40) 
+#define SERVO_PHASE_STEP  300  // most PWM counts between the pulse starts of two channels, less
+                               // at high frame rates so the longest pulse never wraps around
 
 /* *********************************************************************************** */
-/* Servo Settings                                                                      */
+/* Servo Profiles (defaults)                                                           */
+/* *********************************************************************************** */
+
+#define HIP_PULSE_MIN       684   // pulse width in us at 0 degrees
+#define HIP_PULSE_MAX      1953   // pulse width in us at 180 degrees
+#define KNEE_PULSE_MIN      952   // knees are mounted the other way round, 0 degrees
+#define KNEE_PULSE_MAX     2046   // ... is at the long end of the pulse range
+
+#define SERVO_CONFIG_MAGIC  "SRVP01"   // marks valid servo profiles in the config store
+#define SERVO_CONFIG_OFFSET 0          // servo profiles are kept at the start of the userdata
+
+/* *********************************************************************************** */
+/* Servo speed model                                                                   */
+/* *********************************************************************************** */
+
+#define SERVO_MS_PER_60DEG   100   // rated speed (MG90S: 0.1s/60 degrees)
+#define SERVO_NOMINAL_MV    4800   // supply voltage the rated speed refers to
+#define SERVO_LOAD_FACTOR    150   // joints carrying the body take this many percent longer
+#define SERVO_LOAD_KNEE       45   // a leg with the knee at or below this angle carries the body
+#define SERVO_SAFETY_MARGIN   10   // ms added to every predicted move
+
+/* *********************************************************************************** */
+/* Release idle joints                                                                 */
+/* *********************************************************************************** */
+
+#define RELEASE_NONE          0   // keep all joints powered
+#define RELEASE_RAISED        1   // release hip and knee of legs lifted off the ground
+#define RELEASE_IDLE_HIPS     2   // also release idle hips of legs standing on the ground
+#define SERVO_RELEASE_KNEE  150   // a leg with the knee at or above this angle is raised
+#define SERVO_RELEASE_DELAY 250   // ms a joint has to rest before it is released
+#define SERVO_HOLD_MA        20   // estimated current of a servo holding an unloaded joint
+
+/* *********************************************************************************** */
+/* Current budget                                                                      */
+/* *********************************************************************************** */
+
+#define SERVO_CURRENT_BUDGET 2500   // default limit in mA for the current drawn by all servos
+#define SERVO_MOVE_MA         250   // estimated current of a servo moving an unloaded joint
+#define SERVO_FULL_DRIVE_DEG   10   // servos drive at full power when further off than this
+#define SERVO_UNKNOWN_TRAVEL   90   // assumed move for a servo whose position is unknown
+#define SERVO_UNKNOWN      0xFFFF   // position of a servo whose channel has been switched off
+
+/* *********************************************************************************** */
+/* Hip collisions                                                                      */
+/* *********************************************************************************** */
+
+#define HIP_CRASH_LOW         85   // a hip can only hit the next one at or below this angle
+#define HIP_CRASH_HIGH       100   // ... with the next one at or above this angle
+#define HIP_CRASH_DIFF        85   // ... and more than this apart
+#define HIP_SWEEP_STEP_MS      5   // ms between two points checked along the path of a move
+
+/* *********************************************************************************** */
+/* Frame cache                                                                         */
+/* *********************************************************************************** */
+
+#define FRAME_CACHE_SIZE      32   // gait phase frames kept for reuse (a ripple cycle has 19)
+
+/* *********************************************************************************** */
+/* Body pose                                                                           */
+/* *********************************************************************************** */
+
+#define POSE_HEIGHT_MAX       30   // degrees the knees may be bent to raise or lower the body
+#define POSE_ROLL_MAX         20   // degrees the knees may be bent to roll the body
+#define POSE_PITCH_MAX        20   // degrees the knees may be bent to pitch the body
+
+/* *********************************************************************************** */
+/* Phase timing                                                                        */
 /* *********************************************************************************** */
 
-#define HIP_MIN     140
-#define HIP_MAX     400
-#define KNEE_MIN    195
-#define KNEE_MAX    419
+#define MAX_GAIT_PHASES       19   // the ripple gait has the most phases
+#define PHASE_LIFT             0   // raised legs lift at the knees
+#define PHASE_SWING            1   // raised legs swing at the hips
+#define PHASE_LOWER            2   // raised legs are put down at the knees
+#define PHASE_PUSH             3   // legs on the ground move the body at the hips
+#define NUM_PHASE_KINDS        4
 
 // fake value meaning this aspect of the leg (knee or hip) shouldn't move
 #define NOMOVE (-1)   
 
+/* *********************************************************************************** */
+/* Fixed point joint angles                                                            */
+/* *********************************************************************************** */
+
+#define ANGLE_SHIFT   4                              // angles are kept in 1/16 degree
+#define ANGLE(deg)    ((deg) * (1 << ANGLE_SHIFT))   // whole degrees to fixed point
+#define ANGLE_DEG(a)  ((a) / (1 << ANGLE_SHIFT))     // fixed point to whole degrees
+
+typedef int fixangle_t;                              // NOMOVE works for fixed point angles too
+
 // Some info about the geomentry...
 #define LEFT_START  3 // first leg that is on the left side
 #define RIGHT_START 0 // first leg that is on the right side
@@ -71,6 +152,50 @@
 #define ISRIGHTLEG(LEG) (LEG==3||LEG==4||LEG==5)
 
 extern bool ServosDetached;
+extern int  ServoFrequency;
+extern int  ServoFrameMs;
+extern int  ServoSupplyMV;
+extern byte ServoReleasePolicy;
+extern unsigned long ServoChargeSaved;
+extern int  ServoCurrentBudget;
+extern unsigned long SuppressScamperUntil;
+extern unsigned long FrameCacheHits;
+extern unsigned long FrameCacheMisses;
+extern unsigned long ServoSleepRecoveries;
+extern volatile bool ServoInitPending;
+extern unsigned long HipMovesHeld;
+extern unsigned long I2cTransactions;
+extern unsigned long I2cBytes;
+extern byte GaitPhase;
+extern int  PoseHeight;
+extern int  PoseRoll;
+extern int  PosePitch;
+
+/* *********************************************************************************** */
+/* Custom Types                                                                        */
+/* *********************************************************************************** */
+typedef struct {                 // hardware properties of a servo
+  unsigned short pulse_min;      // shortest pulse in us
+  unsigned short pulse_max;      // longest pulse in us
+  byte           reversed;       // 0 degrees is at pulse_max instead of pulse_min
+  unsigned short max_freq;       // highest frame rate the servo accepts in Hz
+  unsigned short ms_per_60deg;   // rated speed
+} servoprofile_t;
+
+typedef struct {                 // servo profiles as kept in the config store
+  char           magic[8];
+  servoprofile_t profile[NUM_SERVO];
+} servoconfig_t;
+
+typedef struct {                 // keeps track of the phase of a gait
+  long          phase;           // current phase
+  unsigned long started;         // hexmillis() when the current phase started
+} gaitphase_t;
+
+typedef struct {                 // share of the cycle time each phase of a gait may take
+  byte          count;           // number of phases
+  unsigned long prefix[MAX_GAIT_PHASES+1];  // sum of the weights of all phases before
+} phasetiming_t;
 
 /* *********************************************************************************** */
 /* Prototypes                                                                          */
@@ -78,29 +203,66 @@ extern bool ServosDetached;
 
 // Initialize Servos
 void initServos(void);
+void restartServoDriver(void);
+void loadServoProfiles(void);
+void saveServoProfiles(void);
+bool setServoProfile(int servonum, const servoprofile_t *profile);
+void setServoSpeed(int ms_per_60deg);
 void checkForServoSleep(void);
 
 // Set servo Position
 void setServo(int servonum, unsigned int position);
+void setServoFixed(int servonum, fixangle_t position);
 
 // Set leg position
 void setLeg(int legmask, int hip_pos, int knee_pos, int adj);
 void setLeg(int legmask, int hip_pos, int knee_pos, int adj, int raw);
 void setLeg(int legmask, int hip_pos, int knee_pos, int adj, int raw, int leanangle);
+void setLegFixed(int legmask, fixangle_t hip_pos, fixangle_t knee_pos, fixangle_t adj, int raw, fixangle_t leanangle);
 
 // Set hip position
 void setHipRaw(int leg, int pos);
 void setHip(int leg, int pos);
 void setHipRawAdj(int leg, int pos, int adj);
+void setHipRawFixed(int leg, fixangle_t pos);
+void setHipFixed(int leg, fixangle_t pos);
+void setHipRawAdjFixed(int leg, fixangle_t pos, fixangle_t adj);
 
 // Set knee position
 void setKnee(int leg, int pos);
+void setKneeFixed(int leg, fixangle_t pos);
+
+// Body pose on top of the gaits
+void setPose(int height, int roll, int pitch);
 
 // help with servo movement
 void checkForCrashingHips(void);
+bool hipPathBlocked(int servonum, fixangle_t position);
 void commitServos();
-void transactServos();
+unsigned short servoPosition(int servonum);
 void detachAllServos();
 unsigned long hexmillis();
 
+// predict servo motion
+long servosRemaining(int percent);
+long gaitPhase(gaitphase_t *gp, const phasetiming_t *timing, long timeperiod);
+long servoMoveTime(int servonum, fixangle_t distance, bool loaded);
+void phaseWeights(long weight[NUM_PHASE_KINDS], const int16_t configured[NUM_PHASE_KINDS], int kneetravel, int hiptravel);
+void setPhaseTiming(phasetiming_t *timing, const byte *kinds, int count, const long weight[NUM_PHASE_KINDS]);
+long phaseSlot(const phasetiming_t *timing, int phase, long timeperiod);
+
+// save energy on idle joints
+void releaseIdleJoints(void);
+void attachReleasedJoints(void);
+int  servosReleased(void);
+
+// stay within the current budget
+long servosCurrent(bool *moving);
+
+// reuse the frames of gait phases
+void frameContext(byte mode, byte submode, byte command);
+bool frameCached(long phase);
+void cacheFrame(long phase);
+void invalidateFrames(void);
+
 #endif
\ No newline at end of file
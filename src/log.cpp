@@ -0,0 +1,112 @@
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Deferred binary event log                                                          */
+/*                                                                                     */
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Copyright 2024 by Bodo Bauer <bb@bb-zone.com>                                      */
+/*                                                                                     */
+/*  This program is free software: you can redistribute it and/or modify               */
+/*  it under the terms of the GNU General Public License as published by               */
+/*  the Free Software Foundation, either version 3 of the License, or                  */
+/*  (at your option) any later version.                                                */
+/*                                                                                     */
+/*  This program is distributed in the hope that it will be useful,                    */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of                     */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                      */
+/*  GNU General Public License for more details.                                       */
+/*                                                                                     */
+/*  You should have received a copy of the GNU General Public License                  */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.              */
+#include <Arduino.h>
+#include "mqtt.h"
+#include "ring.h"
+#include "log.h"
+
+/* *********************************************************************************** *
+ * Logging only copies a 16 byte record into a RAM ring, formatting and output happen 
+ * later in logFlush() from the loop. The serial sink never writes more than the UART
+ * FIFO takes without blocking, the MQTT sink hands batches to the outbound queue. 
+ * contrib/logdecode turns the records back into text.
+ *
+ * Records are written from the loop as well as from the motion task. This is safe with
+ * the single producer ring, as the motion Ticker only runs while the loop yields and
+ * logRecord() never yields.
+ * *********************************************************************************** */
+
+#define LOG_HEX_LEN (2*sizeof(logrecord_t) + 2)    // '~', hex digits and newline
+
+ring_t<logrecord_t, LOG_RECORDS> LogRing;
+unsigned long LogDropped = 0;
+byte          LogSink    = LOG_SINK_DEFAULT;
+
+/* *********************************************************************************** */
+/* @brief Add a record to the log                                                      */
+/* *********************************************************************************** */
+void logRecord(byte level, byte event, int a, int b, int c, int d, int e) {
+  logrecord_t *r = ringClaim(&LogRing);
+
+  if (r == NULL) {
+    LogDropped++;
+    return;
+  }
+  r->time   = millis();
+  r->level  = level;
+  r->event  = event;
+  r->arg[0] = a;
+  r->arg[1] = b;
+  r->arg[2] = c;
+  r->arg[3] = d;
+  r->arg[4] = e;
+  ringPublish(&LogRing);
+}
+
+/* *********************************************************************************** */
+/* @brief Write a record as a line of hex digits to the serial console                 */
+/* *********************************************************************************** */
+bool logToSerial(const logrecord_t *r) {
+  static const char hex[] = "0123456789abcdef";
+  char line[LOG_HEX_LEN];
+  const byte *data = (const byte*)r;
+
+  if (Serial.availableForWrite() < (int)LOG_HEX_LEN) {
+    return false;                      // would block, try again later
+  }
+  line[0] = '~';
+  for (unsigned int i = 0; i < sizeof(logrecord_t); i++) {
+    line[1+2*i] = hex[data[i] >> 4];
+    line[2+2*i] = hex[data[i] & 0x0F];
+  }
+  line[LOG_HEX_LEN-1] = '\n';
+  Serial.write((const uint8_t*)line, LOG_HEX_LEN);
+  return true;
+}
+
+/* *********************************************************************************** *
+ * @brief Drain up to LOG_DRAIN_MAX records to the sink
+ *
+ * The MQTT sink sends all drained records in one message.
+ * *********************************************************************************** */
+void logFlush(void) {
+  logrecord_t batch[LOG_DRAIN_MAX];
+  int count = 0;
+  logrecord_t *r;
+
+  while (count < LOG_DRAIN_MAX && (r = ringPeek(&LogRing)) != NULL) {
+    if (LogSink == LOG_SINK_SERIAL) {
+      if (!logToSerial(r)) {
+        break;
+      }
+    } else if (LogSink == LOG_SINK_MQTT) {
+      batch[count] = *r;
+    } else {
+      break;                           // no sink, keep the records
+    }
+    ringRelease(&LogRing);
+    count++;
+  }
+
+  if (LogSink == LOG_SINK_MQTT && count > 0) {
+    mqttSendData("/%s/Log", (const byte*)batch, count*sizeof(logrecord_t));
+  }
+}
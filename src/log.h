@@ -0,0 +1,112 @@
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Deferred binary event log                                                          */
+/*                                                                                     */
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Copyright 2024 by Bodo Bauer <bb@bb-zone.com>                                      */
+/*                                                                                     */
+/*  This program is free software: you can redistribute it and/or modify               */
+/*  it under the terms of the GNU General Public License as published by               */
+/*  the Free Software Foundation, either version 3 of the License, or                  */
+/*  (at your option) any later version.                                                */
+/*                                                                                     */
+/*  This program is distributed in the hope that it will be useful,                    */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of                     */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                      */
+/*  GNU General Public License for more details.                                       */
+/*                                                                                     */
+/*  You should have received a copy of the GNU General Public License                  */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.              */
+#include <Arduino.h>
+
+#ifndef LOG_H
+#define LOG_H
+
+/* *********************************************************************************** */
+/* Log levels, records below LOG_LEVEL are not even compiled in                        */
+/* *********************************************************************************** */
+
+#define LOG_LEVEL_DEBUG     0
+#define LOG_LEVEL_INFO      1
+#define LOG_LEVEL_WARN      2
+#define LOG_LEVEL_ERROR     3
+#define LOG_LEVEL_NONE      4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO   // override with -DLOG_LEVEL=... in platformio.ini
+#endif
+
+/* *********************************************************************************** */
+/* Log settings                                                                        */
+/* *********************************************************************************** */
+
+#define LOG_RECORDS        64   // records kept in RAM until drained (power of two)
+#define LOG_DRAIN_MAX       8   // records drained per call of logFlush()
+
+#define LOG_SINK_NONE       0   // keep records until the ring is full
+#define LOG_SINK_SERIAL     1   // one hex line per record, only as much as fits the UART FIFO
+#define LOG_SINK_MQTT       2   // binary records in /<myId>/Log messages
+#define LOG_SINK_DEFAULT    LOG_SINK_SERIAL
+
+/* *********************************************************************************** *
+ * Events, keep in sync with contrib/logdecode
+ * *********************************************************************************** */
+
+#define LOG_BOOT            1   // reset reason
+#define LOG_CRASH           2   // leg, position, next leg, position (1/16 degree), adjust
+#define LOG_SERVO_SLEEP     3   // recoveries
+#define LOG_DETACH          4   // -
+#define LOG_SCAMPER_OFF     5   // effort in ms
+#define LOG_MQTT_RX         6   // service index, payload length
+#define LOG_MQTT_UNKNOWN    7   // topic length, payload length
+#define LOG_CMD_DROPPED     8   // dropped so far
+#define LOG_MQTT_CONNECT    9   // reconnects
+#define LOG_MQTT_OVERSIZE  10   // topic length, payload length
+
+extern unsigned long LogDropped;
+extern byte          LogSink;
+
+/* *********************************************************************************** */
+/* Custom Types                                                                        */
+/* *********************************************************************************** */
+
+typedef struct __attribute__((packed)) {   // 16 bytes, little endian
+  uint32_t time;                 // millis()
+  uint8_t  level;
+  uint8_t  event;
+  int16_t  arg[5];
+} logrecord_t;
+
+/* *********************************************************************************** */
+/* Prototypes                                                                          */
+/* *********************************************************************************** */
+
+void logRecord(byte level, byte event, int a = 0, int b = 0, int c = 0, int d = 0, int e = 0);
+void logFlush(void);                       // drain records to the sink (call in loop)
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(event, ...) logRecord(LOG_LEVEL_DEBUG, event, ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(event, ...)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(event, ...)  logRecord(LOG_LEVEL_INFO, event, ##__VA_ARGS__)
+#else
+#define LOG_INFO(event, ...)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(event, ...)  logRecord(LOG_LEVEL_WARN, event, ##__VA_ARGS__)
+#else
+#define LOG_WARN(event, ...)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_ERROR
+#define LOG_ERROR(event, ...) logRecord(LOG_LEVEL_ERROR, event, ##__VA_ARGS__)
+#else
+#define LOG_ERROR(event, ...)
+#endif
+
+#endif
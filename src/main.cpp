@@ -31,11 +31,19 @@
 
 #include "hexabot.h"
 #include "legs.h"
+#include "kinematics.h"
 #include "positions.h"
 #include "tripodgait.h"
 #include "ripplegait.h"
 #include "quadgait.h"
 #include "wave.h"
+#include "crabgait.h"
+#include "params.h"
+#include "motion.h"
+#include "telemetry.h"
+#include "metrics.h"
+#include "log.h"
+#include "blackbox.h"
 
 #define COMMAND_TIMEOUT (3000L)     // Time out commands after 3 seconds
 #define ENERGYSAVER     (10000L)    // Detach Servos after 10s standing still
@@ -60,11 +68,13 @@ void heartbeat(void*);
 void lights(void*);
 
 void resetLastMovement(void);
+void motion(void);
+void executeCommand(char *cmd);
 
 
 // MQTT support
-void  mqttCbCmd(const char*);
-void  mqttCbStatus(const char*);
+void  mqttCbCmd(const char*, unsigned int);
+void  mqttCbStatus(const char*, unsigned int);
 char* parseCommand(char* cmd);
 
 /* *********************************************************************************** */
@@ -89,15 +99,29 @@ service_t mqttServiceList[] = {
 /* *********************************************************************************** */
 /* @brief MQTT Callback: Return Bot Status                                             */
 /* *********************************************************************************** */
-void mqttCbStatus(const char *payload) {
+void mqttCbStatus(const char *payload, unsigned int length) {
   mqttSendMessage("/%s/Error", "Status report not implemented yet");
 }
 
-/* *********************************************************************************** */
-/* @brief MQTT Callback: Process command                                               */
-/* *********************************************************************************** */
-void mqttCbCmd(const char *payload) {
-  char *cmd = strdup(payload);
+/* *********************************************************************************** *
+ * @brief MQTT Callback: Process command
+ *
+ * Commands are not executed here but handed over to the motion task, which runs them
+ * in the order received (see executeCommand()).
+ * *********************************************************************************** */
+void mqttCbCmd(const char *payload, unsigned int length) {
+  if (!queueCommand(payload, length)) {
+    mqttSendMessage("/%s/Error", "Command dropped");
+  }
+}
+
+/* *********************************************************************************** *
+ * @brief Execute a command (motion context)
+ *
+ * Runs in the motion task, so errors are reported with motionReport() rather than
+ * being sent directly.
+ * *********************************************************************************** */
+void executeCommand(char *cmd) {
   char* cursor = parseCommand(cmd);
   
   if (!strcmp(cmd,"SetLeg")) {                               // Move single leg: #Leg °Hip °Knee
@@ -111,6 +135,42 @@ void mqttCbCmd(const char *payload) {
     int hip=atoi(strHip);
     setLeg(leg, hip, knee, 0);
 
+  } else if (!strcmp(cmd,"SetFoot")) {                      // Place single foot: #Leg x y z (mm)
+    botCommand = COMMAND_NONE;
+
+    char *strLeg=cursor;
+    char *strX=parseCommand(strLeg);
+    char *strY=parseCommand(strX);
+    char *strZ=parseCommand(strY);
+    parseCommand(strZ);
+    int leg=atoi(strLeg);
+    foot_t foot = { (int16_t)atoi(strX), (int16_t)atoi(strY), (int16_t)atoi(strZ) };
+    if (leg < 0 || leg >= NUM_LEGS) {
+      motionReport("/%s/Error", "Invalid leg");
+    } else if (!setFoot(leg, &foot)) {
+      motionReport("/%s/Error", "Foot position out of reach");
+    }
+
+  } else if (!strcmp(cmd,"SetLegGeometry")) {               // #Leg x y °Angle Coxa Femur °KneeLevel
+    leggeometry_t geometry;
+    char *strLeg=cursor;
+    char *strX=parseCommand(strLeg);
+    char *strY=parseCommand(strX);
+    char *strAngle=parseCommand(strY);
+    char *strCoxa=parseCommand(strAngle);
+    char *strFemur=parseCommand(strCoxa);
+    char *strLevel=parseCommand(strFemur);
+    parseCommand(strLevel);
+    geometry.mountX     = atoi(strX);
+    geometry.mountY     = atoi(strY);
+    geometry.mountAngle = atoi(strAngle);
+    geometry.coxa       = constrain(atoi(strCoxa), 0, 255);
+    geometry.femur      = constrain(atoi(strFemur), 0, 255);
+    geometry.kneeLevel  = constrain(atoi(strLevel), 0, 255);
+    if (!setLegGeometry(atoi(strLeg), &geometry)) {
+      motionReport("/%s/Error", "Invalid leg geometry");
+    }
+
   } else if (!strcmp(cmd,"SetMode")) {                       // Set movement mode 
     char *strMode=cursor;
     if ( !strcmp(strMode,        "Walk")) {
@@ -121,6 +181,8 @@ void mqttCbCmd(const char *payload) {
       botMode = MODE_QUAD;
     } else if ( !strcmp(strMode, "Wave")) {
       botMode = MODE_WAVE;
+    } else if ( !strcmp(strMode, "Crab")) {
+      botMode = MODE_CRAB;
     } 
 
   } else if (!strcmp(cmd,"SetSubMode")) {                   // Set submode 
@@ -142,6 +204,9 @@ void mqttCbCmd(const char *payload) {
         botSubmode = SUBMODE_1;
         break;
     }
+  } else if (!strcmp(cmd,"SetHeading")) {                   // Heading of the crab gait: ° (0 forward, 90 left)
+    setCrabHeading(atoi(cursor));
+
   } else if (!strcmp(cmd,"Stand90Degrees")) {                // Predefined "Stand 90 Degrees" 
     botCommand = COMMAND_NONE;
     stand_90_degrees();
@@ -190,12 +255,95 @@ void mqttCbCmd(const char *payload) {
     botCommand=COMMAND_NONE;
     detachAllServos();
 
+  } else if (!strcmp(cmd,"SetServoSpeed")) {                // Calibrate servo speed: ms per 60°
+    setServoSpeed(atoi(cursor));
+
+  } else if (!strcmp(cmd,"SetServoProfile")) {              // #Servo µsMin µsMax Reversed HzMax ms/60°
+    servoprofile_t profile;
+    char *strServo=cursor;
+    char *strMin=parseCommand(strServo);
+    char *strMax=parseCommand(strMin);
+    char *strReversed=parseCommand(strMax);
+    char *strFreq=parseCommand(strReversed);
+    char *strSpeed=parseCommand(strFreq);
+    parseCommand(strSpeed);
+    profile.pulse_min    = atoi(strMin);
+    profile.pulse_max    = atoi(strMax);
+    profile.reversed     = atoi(strReversed) ? 1 : 0;
+    profile.max_freq     = atoi(strFreq);
+    profile.ms_per_60deg = atoi(strSpeed);
+    if (!setServoProfile(atoi(strServo), &profile)) {
+      motionReport("/%s/Error", "Invalid servo profile");
+    }
+
+  } else if (!strcmp(cmd,"SaveServoProfiles")) {            // Keep servo profiles in EEPROM
+    saveServoProfiles();
+
+  } else if (!strcmp(cmd,"SetServoSupply")) {               // Servo supply voltage in mV
+    ServoSupplyMV = constrain(atoi(cursor), 3000, 8400);
+
+  } else if (!strcmp(cmd,"SetCurrentBudget")) {             // Servo current budget in mA
+    ServoCurrentBudget = constrain(atoi(cursor), 500, 10000);
+
+  } else if (!strcmp(cmd,"SetPose")) {                      // Body pose: °Height °Roll °Pitch
+    char *strHeight=cursor;
+    char *strRoll=parseCommand(strHeight);
+    char *strPitch=parseCommand(strRoll);
+    parseCommand(strPitch);
+    setPose(atoi(strHeight), atoi(strRoll), atoi(strPitch));
+
+  } else if (!strcmp(cmd,"SetParam")) {                     // Gait parameter: Name Value
+    char *strName=cursor;
+    char *strValue=parseCommand(strName);
+    parseCommand(strValue);
+    if (!setGaitParam(strName, atoi(strValue))) {
+      motionReport("/%s/Error", "Unknown gait parameter or value out of bounds");
+    }
+
+  } else if (!strcmp(cmd,"GetParam")) {                     // Gait parameter: Name, all values if omitted
+    char text[REPORT_LEN];
+    parseCommand(cursor);
+    if (!cursor[0]) {
+      getGaitParams(text, sizeof(text));
+      motionReport("/%s/Param", text);
+    } else if (getGaitParam(cursor, text, sizeof(text))) {
+      motionReport("/%s/Param", text);
+    } else {
+      motionReport("/%s/Error", "Unknown gait parameter");
+    }
+
+  } else if (!strcmp(cmd,"ResetParams")) {                  // Gait parameters back to their defaults
+    resetGaitParams();
+
+  } else if (!strcmp(cmd,"SaveGaitProfile")) {              // Keep gait parameters in EEPROM: Name
+    parseCommand(cursor);
+    if (!saveGaitProfile(cursor)) {
+      motionReport("/%s/Error", "Saving gait profile failed");
+    }
+
+  } else if (!strcmp(cmd,"LoadGaitProfile")) {              // Gait parameters from EEPROM: Name
+    parseCommand(cursor);
+    if (!loadGaitProfile(cursor)) {
+      motionReport("/%s/Error", "Unknown gait profile");
+    }
+
+  } else if (!strcmp(cmd,"SetTelemetryPeriod")) {           // Telemetry sample period in ms, 0 = off
+    setTelemetryPeriod(atoi(cursor));
+
+  } else if (!strcmp(cmd,"SetLogSink")) {                   // Log output: 0 none, 1 serial, 2 MQTT
+    LogSink = constrain(atoi(cursor), LOG_SINK_NONE, LOG_SINK_MQTT);
+
+  } else if (!strcmp(cmd,"SetReleasePolicy")) {             // Release idle joints: 0, 1 or 2
+    ServoReleasePolicy = constrain(atoi(cursor), RELEASE_NONE, RELEASE_IDLE_HIPS);
+    if (ServoReleasePolicy == RELEASE_NONE) {
+      attachReleasedJoints();
+    }
+
   } else {
-    sprintf(msg, "The command %s is not implemented yet", cmd);
-    mqttSendMessage("/%s/Error", msg );
+    char text[REPORT_LEN];
+    snprintf(text, sizeof(text), "The command %s is not implemented yet", cmd);
+    motionReport("/%s/Error", text);
   }
-
-  free(cmd);
 }
 
 /* *********************************************************************************** */
@@ -222,8 +370,14 @@ void lights(void*) {
 void heartbeat(void*) {
   static unsigned long aliveCounter=0;
   
-  sprintf(msg, "#%08ld mode: %c submode: %c command: %c", aliveCounter, botMode, botSubmode, botCommand);
-  mqttSendMessage("/%s/Status", msg);
+  sprintf(msg, "#%08ld mode: %c submode: %c command: %c released: %d (%dmA) saved: %lumAh frames: %lu/%lu"
+               " mqtt: %u/%u dropped: %lu/%lu/%lu/%lu latency: %lu/%lums", 
+          aliveCounter, botMode, botSubmode, botCommand, 
+          servosReleased(), servosReleased()*SERVO_HOLD_MA, ServoChargeSaved/3600,
+          FrameCacheHits, FrameCacheMisses,
+          MqttQueueDepth, MqttQueuePeak, MqttDropped[MQTT_PRIO_ERROR], MqttDropped[MQTT_PRIO_STATUS], 
+          MqttDropped[MQTT_PRIO_TELEMETRY], MqttDropped[MQTT_PRIO_DEBUG], MqttLatencyAvg, MqttLatencyMax);
+  mqttSendMessage("/%s/Status", msg, MQTT_COALESCE_HEARTBEAT);
 
   aliveCounter++;
 }
@@ -235,25 +389,27 @@ void setup() {
 
   // start serial console
   initSerial();
+  initBlackBox();                                          // keep what happened before the reset
+  LOG_INFO(LOG_BOOT, ESP.getResetInfoPtr()->reason);
 
   // load persistent data from EEPROM
   loadFromEEPROM();
+  loadServoProfiles();
+  loadGaitParams();
   
-  // initialize netowrk subsystems
-  initWifi();                                              // connect to WiFi network
-  initOTA();                                               // allow OTA updates
-  initMQTT();                                              // connect to MQTT broker
-
   // some HW setup
   pinMode(LED_BUILTIN, OUTPUT);                            // use on-board LED
   digitalWrite(LED_BUILTIN, 0);                            // turn LED on
   Wire.begin();                                            // Start I2C bus
   initServos();                                            // inittalize servo handling
 
-  mqttSendMessage("/%s/Status", "Boot sequence complete"); // let the word know that
-                                                           // we are ready for business
-
   stand();                                                 // assume standing position
+  initMotion(motion);                                      // from now on the servos are
+                                                           // driven by the motion task
+
+  // initialize netowrk subsystems, WiFi, OTA and MQTT come up in the background
+  // (see network()), which reports the boot sequence as soon as it is connected
+  initWifi();
 }
 
 
@@ -263,7 +419,8 @@ void setup() {
 task_t taskTable[] = {
     //   last run,  interval, task,       argument
     {0L,     500L, lights,              NULL},      // LED effects
-    {0L,    1000L, heartbeat,           NULL},      // sent heartbeat message ecery 10s
+    {0L,   10000L, heartbeat,           NULL},      // sent heartbeat message ecery 10s
+    {0L,       0L, telemetry,           NULL},      // sample telemetry (every loop)
     {0, 0, NULL, NULL},                             // end marker
 };
 
@@ -275,29 +432,47 @@ void resetLastMovement(void) {
   ServosDetached = false;
 }
 
-/* *********************************************************************************** */
-/* @brief From Her to Eternity                                                         */
-/* *********************************************************************************** */
-void loop() {
+/* *********************************************************************************** *
+ * @brief Motion task, runs every MOTION_TICK_MS (see motion.cpp)
+ *
+ * Everything touching the servos happens here. The task must neither yield nor use the
+ * network, MQTT messages are sent with motionReport(). Restarting the servo driver is
+ * left to loop() (see restartServoDriver()).
+ * *********************************************************************************** */
+void motion(void) {
   unsigned long current_time = millis();
+  char *cmd;
 
-  // some useful checks
-  checkForServoSleep();
-  checkForCrashingHips();
+  // keep still while loop() restarts the servo driver
+  if (ServoInitPending) {
+    return;
+  }
 
-  // process MQTT communication
-  client.loop();
+  // execute commands received since the last run, stop at one that restarts the driver
+  while (!ServoInitPending && (cmd = nextCommand()) != NULL) {
+    blackboxCommand(cmd);
+    executeCommand(cmd);
+    commandDone();
+  }
 
-  // check if the is an OTA update request
-  ArduinoOTA.handle();
+  // some useful checks
+  checkForServoSleep();
+  updateScamperGovernor();
+  if (ServoInitPending) {
+    return;
+  }
 
   // let commands time out
   if ( botCommandUpdate < current_time - COMMAND_TIMEOUT ) {
     botCommand = COMMAND_NONE;
   }
 
+  // take over new gait parameters, the gaits hold at the end of their cycle for them
+  updateGaitParams(botCommand != COMMAND_NONE && botCommand != COMMAND_STAND, gaitCycleTime(botMode, botSubmode));
+
   // process commands dependent on mode
   if ( botCommand != COMMAND_NONE ) {
+    frameContext(botMode, botSubmode, botCommand);
     switch(botMode) {
       case MODE_WALK:
         walkTripodGait(botCommand, botSubmode);
@@ -315,15 +490,68 @@ void loop() {
         wave(botCommand);
         break;
 
+      case MODE_CRAB:
+        walkCrabGait(botCommand);
+        break;
+
     }
     resetLastMovement();
   }
+
+  // commit everything written to the servo frame outside the gaits (e.g. by commands) as
+  // well as moves held back by the current budget, switch off joints that do not need to 
+  // hold a position
+  commitServos();
+  releaseIdleJoints();
+
+  // the robot stands once the boot position has been reached by all servos
+  if (BootStandMs == 0 && servosRemaining(100) == 0) {
+    BootStandMs = millis();
+  }
  
   if ( ServosDetached == false && ( (millis() - lastMovement) > ENERGYSAVER) ) {
     detachAllServos();
-    mqttDebug("Servos Detached");
+    motionReport("/%s/Debug", "Servos Detached");
   }
- 
+}
+
+/* *********************************************************************************** */
+/* @brief From Her to Eternity                                                         */
+/* *********************************************************************************** */
+void loop() {
+  unsigned long current_time = millis();
+  unsigned long started = micros();
+
+  // restart the servo driver if the motion task asked for it, this needs delay()
+  restartServoDriver();
+
+  // bring up and keep up the network connections
+  network();
+
+  // process MQTT communication
+  client.loop();
+
+  // check if the is an OTA update request
+  if (otaActive) {
+    ArduinoOTA.handle();
+  }
+
+  // publish what the motion task has to say and whatever else is queued
+  publishReports();
+  mqttFlush();
+
+  // answer metrics scrapes
+  handleMetrics();
+
+  // write the flash for profiles saved by the motion task, it blocks for tens of ms
+  if (!saveDeferredToEEPROM()) {
+    mqttSendMessage("/%s/Error", "Saving to EEPROM failed");
+  }
+
+  // drain the log, report what happened before the last reset
+  logFlush();
+  publishBlackBox();
+
   // process tasks table
   for (int index = 0; taskTable[index].task != NULL; index++) {
     if (current_time - taskTable[index].last_time >= taskTable[index].interval) {
@@ -334,4 +562,10 @@ void loop() {
       taskTable[index].last_time = current_time;
     }
   }  
+
+  unsigned long duration = micros() - started;
+  observe(&LoopTime, duration);
+  if (duration > BLACKBOX_LOOP_OVERRUN * 1000UL) {
+    blackboxOverrun(0, duration / 1000);
+  }
 }
\ No newline at end of file
@@ -0,0 +1,188 @@
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Prometheus metrics endpoint of the hexapod                                         */
+/*                                                                                     */
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Copyright 2024 by Bodo Bauer <bb@bb-zone.com>                                      */
+/*                                                                                     */
+/*  This program is free software: you can redistribute it and/or modify               */
+/*  it under the terms of the GNU General Public License as published by               */
+/*  the Free Software Foundation, either version 3 of the License, or                  */
+/*  (at your option) any later version.                                                */
+/*                                                                                     */
+/*  This program is distributed in the hope that it will be useful,                    */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of                     */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                      */
+/*  GNU General Public License for more details.                                       */
+/*                                                                                     */
+/*  You should have received a copy of the GNU General Public License                  */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.              */
+#include <Arduino.h>
+#include <stdarg.h>
+#include <ESP8266WebServer.h>
+#include "wifi.h"
+#include "legs.h"
+#include "mqtt.h"
+#include "motion.h"
+#include "metrics.h"
+#include "log.h"
+#include "crabgait.h"
+
+/* *********************************************************************************** *
+ * GET /metrics returns the counters of the firmware in the Prometheus text format. The
+ * response is written line by line into a static buffer which is sent as an HTTP chunk
+ * whenever it is full, so serving a scrape needs no heap and only takes as long as 
+ * the network needs for a few small chunks.
+ * *********************************************************************************** */
+
+ESP8266WebServer metricsServer(METRICS_PORT);
+
+const unsigned long HistogramBounds[HISTOGRAM_BUCKETS] = { 
+  100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000 
+};
+
+histogram_t LoopTime;                  // duration of loop() (network context)
+histogram_t MotionTime;                // duration of the motion task
+
+static char chunk[METRICS_CHUNK];
+static int  chunkLength = 0;
+
+/* *********************************************************************************** */
+/* @brief Add a duration to a histogram                                                */
+/* *********************************************************************************** */
+void observe(histogram_t *h, unsigned long us) {
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    if (us <= HistogramBounds[i]) {
+      h->bucket[i]++;
+      break;
+    }
+  }
+  h->count++;
+  h->sum += us;
+}
+
+/* *********************************************************************************** */
+/* @brief Send what has been collected in the chunk buffer                             */
+/* *********************************************************************************** */
+static void flushMetrics(void) {
+  if (chunkLength > 0) {
+    metricsServer.sendContent(chunk, chunkLength);
+    chunkLength = 0;
+  }
+}
+
+/* *********************************************************************************** */
+/* @brief Append a line to the response                                                */
+/* *********************************************************************************** */
+static void emit(const char *fmt, ...) {
+  char line[METRICS_LINE];
+  va_list args;
+
+  va_start(args, fmt);
+  int length = vsnprintf(line, sizeof(line), fmt, args);
+  va_end(args);
+  if (length < 0) {
+    return;
+  }
+  length = min(length, METRICS_LINE-1);
+
+  if (chunkLength + length > METRICS_CHUNK) {
+    flushMetrics();
+  }
+  memcpy(chunk + chunkLength, line, length);
+  chunkLength += length;
+}
+
+/* *********************************************************************************** */
+/* @brief Append HELP and TYPE of a metric                                             */
+/* *********************************************************************************** */
+static void describe(const char *name, const char *type, const char *help) {
+  emit("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void counter(const char *name, const char *help, unsigned long value) {
+  describe(name, "counter", help);
+  emit("%s %lu\n", name, value);
+}
+
+static void gauge(const char *name, const char *help, long value) {
+  describe(name, "gauge", help);
+  emit("%s %ld\n", name, value);
+}
+
+static void histogram(const char *name, const char *help, const histogram_t *h) {
+  unsigned long cumulative = 0;
+
+  describe(name, "histogram", help);
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    cumulative += h->bucket[i];
+    emit("%s_bucket{le=\"%lu\"} %lu\n", name, HistogramBounds[i], cumulative);
+  }
+  emit("%s_bucket{le=\"+Inf\"} %lu\n%s_sum %lu\n%s_count %lu\n", name, h->count, name, h->sum, name, h->count);
+}
+
+/* *********************************************************************************** */
+/* @brief Handler for GET /metrics                                                     */
+/* *********************************************************************************** */
+static void serveMetrics(void) {
+  metricsServer.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  metricsServer.send(200, "text/plain; version=0.0.4", "");
+  chunkLength = 0;
+
+  histogram("hexabot_loop_duration_microseconds",   "Duration of the main loop", &LoopTime);
+  histogram("hexabot_motion_duration_microseconds", "Duration of the motion task", &MotionTime);
+  counter("hexabot_motion_ticks_total",      "Runs of the motion task", MotionTicks);
+
+  counter("hexabot_i2c_transactions_total",  "I2C transactions with the servo driver", I2cTransactions);
+  counter("hexabot_i2c_bytes_total",         "Bytes on the I2C bus including address bytes", I2cBytes);
+  counter("hexabot_servo_sleep_recoveries_total", "Times the servo driver had to be woken up", ServoSleepRecoveries);
+  counter("hexabot_hip_moves_held_total",   "Commits a hip move waited for a neighbour to avoid a collision on the way", HipMovesHeld);
+  gauge("hexabot_servos_released",           "Joints switched off to save energy", servosReleased());
+  counter("hexabot_frame_cache_hits_total",  "Gait frames reused from the frame cache", FrameCacheHits);
+  counter("hexabot_frame_cache_misses_total","Gait frames computed", FrameCacheMisses);
+  gauge("hexabot_crab_commanded_mm",        "Distance the crab gait was commanded to move the body", CrabCommanded);
+  gauge("hexabot_crab_achieved_mm",         "Distance the crab gait moved the body according to the kinematics", CrabAchieved);
+
+  counter("hexabot_commands_total",          "Commands executed", CommandsExecuted);
+  counter("hexabot_commands_dropped_total",  "Commands dropped because the queue was full or they were too long", CommandsDropped);
+  counter("hexabot_log_dropped_total",       "Log records dropped because the ring was full", LogDropped);
+  counter("hexabot_reports_dropped_total",   "Messages of the motion task dropped because the queue was full", ReportsDropped);
+
+  counter("hexabot_mqtt_reconnects_total",   "Connections to the MQTT broker after the first", MqttReconnects);
+  counter("hexabot_mqtt_oversize_total",     "Incoming messages rejected for their size", MqttOversize);
+  counter("hexabot_mqtt_unknown_total",      "Incoming messages without a matching service", MqttUnknown);
+  gauge("hexabot_mqtt_queue_depth",          "Messages waiting to be published", MqttQueueDepth);
+  gauge("hexabot_mqtt_latency_max_milliseconds", "Longest time a message waited to be published", MqttLatencyMax);
+  describe("hexabot_mqtt_dropped_total", "counter", "Messages dropped from the outbound queue");
+  emit("hexabot_mqtt_dropped_total{priority=\"error\"} %lu\n",     MqttDropped[MQTT_PRIO_ERROR]);
+  emit("hexabot_mqtt_dropped_total{priority=\"status\"} %lu\n",    MqttDropped[MQTT_PRIO_STATUS]);
+  emit("hexabot_mqtt_dropped_total{priority=\"telemetry\"} %lu\n", MqttDropped[MQTT_PRIO_TELEMETRY]);
+  emit("hexabot_mqtt_dropped_total{priority=\"debug\"} %lu\n",     MqttDropped[MQTT_PRIO_DEBUG]);
+
+  gauge("hexabot_heap_free_bytes",           "Free heap", ESP.getFreeHeap());
+  gauge("hexabot_heap_max_block_bytes",      "Largest free block on the heap", ESP.getMaxFreeBlockSize());
+  gauge("hexabot_wifi_rssi_dbm",             "Wi-Fi signal strength", WiFi.RSSI());
+  counter("hexabot_uptime_milliseconds_total", "Time since boot", millis());
+  gauge("hexabot_boot_stand_milliseconds",   "Time from boot until the robot was standing", BootStandMs);
+  gauge("hexabot_boot_wifi_milliseconds",    "Time from boot until Wi-Fi was connected", BootWifiMs);
+  gauge("hexabot_boot_mqtt_milliseconds",    "Time from boot until the MQTT broker was connected", BootMqttMs);
+
+  flushMetrics();
+  metricsServer.sendContent("");       // terminating chunk
+}
+
+/* *********************************************************************************** */
+/* @brief Start the HTTP server                                                        */
+/* *********************************************************************************** */
+void initMetrics(void) {
+  metricsServer.on("/metrics", HTTP_GET, serveMetrics);
+  metricsServer.begin();
+}
+
+/* *********************************************************************************** */
+/* @brief Serve pending HTTP requests                                                  */
+/* *********************************************************************************** */
+void handleMetrics(void) {
+  metricsServer.handleClient();
+}
@@ -0,0 +1,56 @@
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Prometheus metrics endpoint of the hexapod                                         */
+/*                                                                                     */
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Copyright 2024 by Bodo Bauer <bb@bb-zone.com>                                      */
+/*                                                                                     */
+/*  This program is free software: you can redistribute it and/or modify               */
+/*  it under the terms of the GNU General Public License as published by               */
+/*  the Free Software Foundation, either version 3 of the License, or                  */
+/*  (at your option) any later version.                                                */
+/*                                                                                     */
+/*  This program is distributed in the hope that it will be useful,                    */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of                     */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                      */
+/*  GNU General Public License for more details.                                       */
+/*                                                                                     */
+/*  You should have received a copy of the GNU General Public License                  */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.              */
+#include <Arduino.h>
+
+#ifndef METRICS_H
+#define METRICS_H
+
+/* *********************************************************************************** */
+/* Metrics settings                                                                    */
+/* *********************************************************************************** */
+
+#define METRICS_PORT        80   // scrape http://<robot>/metrics
+#define METRICS_CHUNK      512   // response is sent in chunks of up to this many bytes
+#define METRICS_LINE       160   // longest single line of the response
+#define HISTOGRAM_BUCKETS   10   // see HistogramBounds in metrics.cpp
+
+/* *********************************************************************************** */
+/* Custom Types                                                                        */
+/* *********************************************************************************** */
+
+typedef struct {                               // durations in us
+  unsigned long bucket[HISTOGRAM_BUCKETS];     // observations per bucket (not cumulative)
+  unsigned long count;                         // all observations, including those above the last bucket
+  unsigned long sum;
+} histogram_t;
+
+extern histogram_t LoopTime;
+extern histogram_t MotionTime;
+
+/* *********************************************************************************** */
+/* Prototypes                                                                          */
+/* *********************************************************************************** */
+
+void initMetrics(void);                                  // start the HTTP server
+void handleMetrics(void);                                // serve requests (call in loop)
+void observe(histogram_t *h, unsigned long us);          // add a duration to a histogram
+
+#endif
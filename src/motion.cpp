@@ -0,0 +1,155 @@
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Motion context of the hexapod                                                      */
+/*                                                                                     */
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Copyright 2024 by Bodo Bauer <bb@bb-zone.com>                                      */
+/*                                                                                     */
+/*  This program is free software: you can redistribute it and/or modify               */
+/*  it under the terms of the GNU General Public License as published by               */
+/*  the Free Software Foundation, either version 3 of the License, or                  */
+/*  (at your option) any later version.                                                */
+/*                                                                                     */
+/*  This program is distributed in the hope that it will be useful,                    */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of                     */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                      */
+/*  GNU General Public License for more details.                                       */
+/*                                                                                     */
+/*  You should have received a copy of the GNU General Public License                  */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.              */
+#include <Arduino.h>
+#include <Ticker.h>
+#include "mqtt.h"
+#include "ring.h"
+#include "motion.h"
+#include "metrics.h"
+#include "log.h"
+#include "blackbox.h"
+
+/* *********************************************************************************** *
+ * Networking (MQTT, OTA and the task table) runs in loop(), servo motion runs from a
+ * Ticker every MOTION_TICK_MS. Ticker callbacks run whenever loop() returns or yields,
+ * which includes waiting for the network, so a slow broker no longer delays the 
+ * servos. The two contexts only talk through two lock-free rings: commands flow from
+ * the MQTT callbacks to the motion task, reports flow back to be published by loop().
+ * The motion task must not call the network or yield()/delay() itself, work that needs
+ * them (e.g. restarting the servo driver) is left to loop().
+ * *********************************************************************************** */
+
+typedef struct {
+  char text[COMMAND_LEN];
+} command_t;
+
+typedef struct {
+  const char *topicFmt;                // a %s in the topic will be replaced by 'myId'
+  char        text[REPORT_LEN];
+} report_t;
+
+ring_t<command_t, COMMAND_QUEUE_LEN> CommandQueue;
+ring_t<report_t,  REPORT_QUEUE_LEN>  ReportQueue;
+
+Ticker motionTicker;
+void (*motionTask)(void) = NULL;
+
+unsigned long MotionTicks     = 0;
+unsigned long CommandsDropped = 0;     // commands lost because the queue was full or they were too long
+unsigned long ReportsDropped  = 0;     // reports lost because the queue was full
+unsigned long CommandsExecuted = 0;
+
+/* *********************************************************************************** */
+/* @brief Ticker callback of the motion context                                        */
+/* *********************************************************************************** */
+void motionTick(void) {
+  unsigned long started = micros();
+
+  MotionTicks++;
+  if (motionTask) {
+    motionTask();
+  }
+  unsigned long duration = micros() - started;
+  observe(&MotionTime, duration);
+  if (duration > MOTION_TICK_MS * 1000UL) {
+    blackboxOverrun(1, duration / 1000);
+  }
+}
+
+/* *********************************************************************************** */
+/* @brief Start running the motion task every MOTION_TICK_MS                           */
+/* *********************************************************************************** */
+void initMotion(void (*task)(void)) {
+  motionTask = task;
+  motionTicker.attach_ms(MOTION_TICK_MS, motionTick);
+}
+
+/* *********************************************************************************** *
+ * @brief Hand a command over to the motion task (network context)
+ *
+ * The command does not need to be zero terminated, it is copied into the queue.
+ *
+ * @retval 'true'   if the command has been queued,
+ *         'false'  if the queue is full or the command is too long
+ * *********************************************************************************** */
+bool queueCommand(const char *command, unsigned int length) {
+  command_t *slot = ringClaim(&CommandQueue);
+
+  if (slot == NULL || length >= COMMAND_LEN) {
+    CommandsDropped++;
+    LOG_WARN(LOG_CMD_DROPPED, CommandsDropped);
+    return false;
+  }
+  memcpy(slot->text, command, length);
+  slot->text[length] = (char)0;
+  ringPublish(&CommandQueue);
+  return true;
+}
+
+/* *********************************************************************************** */
+/* @brief Oldest command waiting for the motion task, NULL if there is none            */
+/* *********************************************************************************** */
+char* nextCommand(void) {
+  command_t *slot = ringPeek(&CommandQueue);
+  return slot ? slot->text : NULL;
+}
+
+/* *********************************************************************************** */
+/* @brief The command returned by nextCommand() has been executed                      */
+/* *********************************************************************************** */
+void commandDone(void) {
+  ringRelease(&CommandQueue);
+  CommandsExecuted++;
+}
+
+/* *********************************************************************************** *
+ * @brief Queue an MQTT message from the motion context
+ *
+ * Messages longer than REPORT_LEN are truncated.
+ *
+ * @retval 'true'   if the message has been queued,
+ *         'false'  if the queue is full
+ * *********************************************************************************** */
+bool motionReport(const char *topicFmt, const char *message) {
+  report_t *slot = ringClaim(&ReportQueue);
+
+  if (slot == NULL) {
+    ReportsDropped++;
+    return false;
+  }
+  slot->topicFmt = topicFmt;
+  strncpy(slot->text, message, REPORT_LEN-1);
+  slot->text[REPORT_LEN-1] = (char)0;
+  ringPublish(&ReportQueue);
+  return true;
+}
+
+/* *********************************************************************************** */
+/* @brief Publish everything the motion task reported (network context)                */
+/* *********************************************************************************** */
+void publishReports(void) {
+  report_t *slot;
+
+  while ((slot = ringPeek(&ReportQueue)) != NULL) {
+    mqttSendMessage(slot->topicFmt, slot->text);
+    ringRelease(&ReportQueue);
+  }
+}
@@ -0,0 +1,56 @@
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Motion context of the hexapod                                                      */
+/*                                                                                     */
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Copyright 2024 by Bodo Bauer <bb@bb-zone.com>                                      */
+/*                                                                                     */
+/*  This program is free software: you can redistribute it and/or modify               */
+/*  it under the terms of the GNU General Public License as published by               */
+/*  the Free Software Foundation, either version 3 of the License, or                  */
+/*  (at your option) any later version.                                                */
+/*                                                                                     */
+/*  This program is distributed in the hope that it will be useful,                    */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of                     */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                      */
+/*  GNU General Public License for more details.                                       */
+/*                                                                                     */
+/*  You should have received a copy of the GNU General Public License                  */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.              */
+#include <Arduino.h>
+
+#ifndef MOTION_H
+#define MOTION_H
+
+/* *********************************************************************************** */
+/* Motion context                                                                      */
+/* *********************************************************************************** */
+
+#define MOTION_TICK_MS       10   // the motion task runs every 10ms
+#define COMMAND_QUEUE_LEN     8   // commands waiting for the motion task (power of two)
+#define COMMAND_LEN          64   // longest command including the terminating zero
+#define REPORT_QUEUE_LEN      8   // reports waiting to be published (power of two)
+#define REPORT_LEN          128   // longest report including the terminating zero
+
+extern unsigned long MotionTicks;
+extern unsigned long CommandsDropped;
+extern unsigned long ReportsDropped;
+extern unsigned long CommandsExecuted;
+
+/* *********************************************************************************** */
+/* Prototypes                                                                          */
+/* *********************************************************************************** */
+
+void initMotion(void (*task)(void));                     // run task every MOTION_TICK_MS
+
+// network context
+bool queueCommand(const char *command, unsigned int length);  // hand a command to the motion task
+void publishReports(void);                               // publish reports of the motion task
+
+// motion context
+char* nextCommand(void);                                 // oldest queued command or NULL
+void  commandDone(void);                                 // release the command of nextCommand()
+bool  motionReport(const char *topicFmt, const char *message);  // queue an MQTT message
+
+#endif
@@ -22,12 +22,15 @@
 #include "wifi.h"
 #include "mqtt.h"
 #include "serial.h"
+#include "log.h"
 
 /* *********************************************************************************** */
 /* Global variables                                                                    */
 /* *********************************************************************************** */
 static char inTopic[256];
-static char buffer[512];
+static unsigned int inTopicLen = 0;       // length of "/<myId>/Command/"
+static byte routeLen[MQTT_MAX_SERVICES];  // length of the names in mqttServiceList
+static int  routeCount = 0;
 
 extern service_t mqttServiceList[]; // list of callback functions for incoming MQTT messages.
 
@@ -36,136 +39,292 @@ extern service_t mqttServiceList[]; // list of callback functions for incoming M
 /* *********************************************************************************** */
 
 void mqttCallback ( char* topic, byte* payload, unsigned int length);
+void mqttBuildRoutes(void);
 
 /* *********************************************************************************** *
  * @brief Connect to MQTT broker                                                       
  *                                                                                     
- * Make 10 attempts to connect to the MQTT broker                                      
+ * Makes a single attempt to connect to the MQTT broker, retrying is up to the caller
+ * (see network()).
  *                                                                                     
- * @retval 'true'   on success,                                                         
+ * @retval 'true'   on success or if already connected,                                                         
  *         'false'  if no connection could be established                              
  * *********************************************************************************** */
 bool initMQTT(void) {
-    uint8_t count = 1;
-    bool connected = client.connected();
-
-    // Loop 10 times until we're reconnected
-    while ( !connected && count<=10 ) {
-        // PRINT("Attempting MQTT connection...");
-        // Attempt to connect
-        sprintf(inTopic, "/%s/Command/#", myId);
-
-        client.setServer(MQTT_BROKER, MQTT_PORT);
-
-        if (client.connect(myId)) {
-            PRINT( "Connected to MQTT broker " );
-            PRINT( MQTT_BROKER ); PRINT(":"); PRINT(MQTT_PORT);
-            client.subscribe(inTopic);
-            PRINT( " and subscribed to topic: " );
-            PRINTLN( inTopic );
-            connected = true;
-            client.setCallback(mqttCallback);
-        } else {
-            // Wait 5 seconds before retrying
-            delay(5000);
-            count++;
-        }
+    static bool wasConnected = false;
+
+    if ( client.connected() ) {
+        return true;
+    }
+
+    sprintf(inTopic, "/%s/Command/#", myId);
+    inTopicLen = strlen(inTopic) - 1;
+    mqttBuildRoutes();
+    client.setServer(MQTT_BROKER, MQTT_PORT);
+    client.setBufferSize(MQTT_PACKET_LEN);    // the default of 256 bytes is too small for telemetry frames
+
+    if ( !client.connect(myId) ) {
+        return false;
     }
 
-    return connected;
+    PRINT( "Connected to MQTT broker " );
+    PRINT( MQTT_BROKER ); PRINT(":"); PRINT(MQTT_PORT);
+    client.subscribe(inTopic);
+    PRINT( " and subscribed to topic: " );
+    PRINTLN( inTopic );
+    client.setCallback(mqttCallback);
+    if ( wasConnected ) {
+        MqttReconnects++;
+    }
+    wasConnected = true;
+    LOG_INFO(LOG_MQTT_CONNECT, MqttReconnects);
+    return true;
+}
+
+/* *********************************************************************************** *
+ * Outbound queue
+ *
+ * Messages are not published right away but queued and sent by mqttFlush() from the 
+ * loop, so a full TCP buffer or a lost broker never blocks the caller. The queue has a
+ * fixed number of slots. Messages are sent by priority (errors before status before
+ * debug) and in order within the same priority. Periodic reports of a state, e.g. the
+ * heartbeat, are sent with a coalesce key: they replace a queued message with the same
+ * key, as only the latest state is of interest. Other messages, e.g. replies to 
+ * requests, are never replaced while there is room in the queue. When the queue is full,
+ * the oldest message of the lowest priority is dropped, unless the new message has an
+ * even lower priority, then the new message is dropped.
+ * *********************************************************************************** */
+typedef struct {
+    const char    *topicFmt;           // a %s in the topic will be replaced by 'myId', NULL if unused
+    byte           priority;
+    byte           coalesce;           // MQTT_COALESCE_NONE or the source of a periodic report
+    unsigned long  sequence;           // keeps the order within a priority
+    unsigned long  queued;             // millis() when the message was queued
+    unsigned int   length;
+    char           message[MQTT_MSG_LEN];
+} outmsg_t;
+
+static outmsg_t      outQueue[MQTT_QUEUE_LEN];
+static unsigned long outSequence = 0;
+
+unsigned int  MqttQueueDepth = 0;
+unsigned int  MqttQueuePeak  = 0;
+unsigned long MqttDropped[MQTT_NUM_PRIO] = { 0, 0, 0, 0 };
+unsigned long MqttLatencyMax = 0;
+unsigned long MqttLatencyAvg = 0;
+unsigned long MqttReconnects = 0;
+unsigned long MqttOversize   = 0;
+unsigned long MqttUnknown    = 0;
+
+/* *********************************************************************************** */
+/* @brief Priority of a message derived from its topic                                 */
+/* *********************************************************************************** */
+byte mqttPriority( const char* topicFmt ) {
+    const char *leaf = strrchr(topicFmt, '/');
+
+    if ( leaf && (!strcmp(leaf, "/Error") || !strcmp(leaf, "/BlackBox")) ) {
+        return MQTT_PRIO_ERROR;
+    }
+    if ( leaf && (!strcmp(leaf, "/Debug") || !strcmp(leaf, "/Log")) ) {
+        return MQTT_PRIO_DEBUG;
+    }
+    if ( leaf && !strcmp(leaf, "/Telemetry") ) {
+        return MQTT_PRIO_TELEMETRY;
+    }
+    return MQTT_PRIO_STATUS;
+}
+
+/* *********************************************************************************** *
+ * @brief Find the slot for a new message
+ *
+ * @retval a free or replaceable slot, NULL if the message has to be dropped
+ * *********************************************************************************** */
+outmsg_t* mqttSlot( byte priority, byte coalesce ) {
+    outmsg_t *victim = NULL;
+
+    for ( int i = 0; coalesce != MQTT_COALESCE_NONE && i < MQTT_QUEUE_LEN; i++ ) {
+        if ( outQueue[i].topicFmt != NULL && outQueue[i].coalesce == coalesce ) {
+            return &outQueue[i];       // superseded report
+        }
+    }
+    for ( int i = 0; i < MQTT_QUEUE_LEN; i++ ) {
+        if ( outQueue[i].topicFmt == NULL ) {
+            MqttQueueDepth++;
+            if ( MqttQueueDepth > MqttQueuePeak ) {
+                MqttQueuePeak = MqttQueueDepth;
+            }
+            return &outQueue[i];
+        }
+        if ( victim == NULL || outQueue[i].priority < victim->priority ||
+             ( outQueue[i].priority == victim->priority && outQueue[i].sequence < victim->sequence ) ) {
+            victim = &outQueue[i];
+        }
+    }
+    if ( victim->priority > priority ) {
+        MqttDropped[priority]++;
+        return NULL;
+    }
+    MqttDropped[victim->priority]++;
+    return victim;
 }
 
 /* *********************************************************************************** *
  * @brief Send debug message over MQTT                                                       
  * 
- * A message with the topic /<myId>/Debug will be sent to the broker
+ * A message with the topic /<myId>/Debug will be queued for the broker
  *                                                                                     
- * @param  message  The debug message. A %s in the message will be replaced by 'myId'
+ * @param  message  The debug message.
  * *                                                                                    
- * @retval 'true'   if message has been sent,                                                         
- *         'false'  if sending the MQTT message failed                              
+ * @retval 'true'   if message has been queued,                                                         
+ *         'false'  if the message has been dropped
  * *********************************************************************************** */
 bool mqttDebug( const char* message ) {
-    bool retval = true;
-
-    if ( initMQTT() ) {
-        char outTopic[64];
-        char outMessage[128];
-        
-        sprintf (outTopic,   "/%s/Debug", myId);
-        sprintf (outMessage, "%s", message);
-        
-        if (!client.publish(outTopic, outMessage)) {
-            retval = false;
-        }
-        client.loop();
-    }
-    return retval;
+    return mqttSendMessage("/%s/Debug", message);
 }
 
 /* *********************************************************************************** *
- * @brief Send debug message over MQTT                                                       
+ * @brief Send message over MQTT                                                       
  * 
- * A the given message with the given topic will be sent to the broker
+ * The given message with the given topic will be queued for the broker. Messages 
+ * longer than MQTT_MSG_LEN are truncated.
  *                                                                                     
- * @param  topicFmt The topic to be used. A %s will be replaced by 'myId'
+ * @param  topicFmt The topic to be used. A %s will be replaced by 'myId', it has to 
+ *                  stay valid until the message has been published (string literal)
  * @param  message  The intended message
  *                                                
- * @retval 'true'   if message has been sent,                                                         
- *         'false'  if sending the MQTT message failed                              
+ * @retval 'true'   if message has been queued,                                                         
+ *         'false'  if the message has been dropped
  * *********************************************************************************** */
 bool mqttSendMessage( const char* topicFmt, const char* message ) {
-    bool retval = true;
-
-    if ( initMQTT() ) {
-        char outTopic[64];
-        
-        sprintf (outTopic, topicFmt, myId);
-        
-        if (!client.publish(outTopic, message)) {
-            retval = false;
+    return mqttSendData(topicFmt, (const byte*)message, strlen(message), MQTT_COALESCE_NONE);
+}
+
+/* *********************************************************************************** *
+ * @brief Send a periodic report over MQTT
+ * 
+ * Like mqttSendMessage(), but a message still queued with the same coalesce key 
+ * (MQTT_COALESCE_...) is replaced.
+ * *********************************************************************************** */
+bool mqttSendMessage( const char* topicFmt, const char* message, byte coalesce ) {
+    return mqttSendData(topicFmt, (const byte*)message, strlen(message), coalesce);
+}
+
+/* *********************************************************************************** *
+ * @brief Send binary message over MQTT                                                       
+ * 
+ * Like mqttSendMessage(), but the payload may contain any bytes. Messages longer than
+ * MQTT_MSG_LEN-1 bytes are truncated.
+ * *********************************************************************************** */
+bool mqttSendData( const char* topicFmt, const byte* data, unsigned int length ) {
+    return mqttSendData(topicFmt, data, length, MQTT_COALESCE_NONE);
+}
+
+bool mqttSendData( const char* topicFmt, const byte* data, unsigned int length, byte coalesce ) {
+    byte priority = mqttPriority(topicFmt);
+    outmsg_t *slot = mqttSlot(priority, coalesce);
+
+    if ( slot == NULL ) {
+        return false;
+    }
+    length = min(length, (unsigned int)(MQTT_MSG_LEN-1));
+    slot->topicFmt = topicFmt;
+    slot->priority = priority;
+    slot->coalesce = coalesce;
+    slot->sequence = outSequence++;
+    slot->queued   = millis();
+    slot->length   = length;
+    memcpy(slot->message, data, length);
+    slot->message[length] = (char)0;
+    return true;
+}
+
+/* *********************************************************************************** *
+ * @brief Publish queued messages                                                       
+ * 
+ * Sends up to MQTT_FLUSH_MAX messages, highest priority first. If publishing fails 
+ * the message stays queued and is retried with the next call.
+ * *********************************************************************************** */
+void mqttFlush(void) {
+    if ( MqttQueueDepth == 0 || !client.connected() ) {
+        return;
+    }
+
+    for ( int count = 0; count < MQTT_FLUSH_MAX && MqttQueueDepth > 0; count++ ) {
+        outmsg_t *next = NULL;
+
+        for ( int i = 0; i < MQTT_QUEUE_LEN; i++ ) {
+            if ( outQueue[i].topicFmt == NULL ) {
+                continue;
+            }
+            if ( next == NULL || outQueue[i].priority > next->priority ||
+                 ( outQueue[i].priority == next->priority && outQueue[i].sequence < next->sequence ) ) {
+                next = &outQueue[i];
+            }
+        }
+
+        char outTopic[MQTT_TOPIC_LEN];
+        snprintf(outTopic, sizeof(outTopic), next->topicFmt, myId);
+        if ( !client.publish(outTopic, (const uint8_t*)next->message, next->length) ) {
+            return;                    // TCP buffers are full, try again later
+        }
+
+        unsigned long latency = millis() - next->queued;
+        if ( latency > MqttLatencyMax ) {
+            MqttLatencyMax = latency;
         }
-        client.loop();
+        MqttLatencyAvg = (MqttLatencyAvg * 7 + latency) / 8;
+
+        next->topicFmt = NULL;
+        MqttQueueDepth--;
+    }
+}
+
+/* *********************************************************************************** *
+ * @brief Precompute the routing table for incoming messages
+ *
+ * The lengths of the service names are computed once, so incoming topics can be 
+ * matched exactly with a length check and a memcmp().
+ * *********************************************************************************** */
+void mqttBuildRoutes(void) {
+    routeCount = 0;
+    while ( routeCount < MQTT_MAX_SERVICES && mqttServiceList[routeCount].name != NULL ) {
+        routeLen[routeCount] = strlen(mqttServiceList[routeCount].name);
+        routeCount++;
     }
-    return retval;
 }
 
 /* *********************************************************************************** *
  * @brief Handle incoming MQTT messages
  *
  * Generic MQTT callback for all messages matching the topic "/<myId>/Command/#
- * If <mqttServiceList> contains a matching topic, the refenced function will be called.
+ * If <mqttServiceList> contains an entry exactly matching the rest of the topic, the
+ * refenced function will be called. The payload is handed over as it is in the buffer 
+ * of the MQTT client, it is not zero terminated. Payloads longer than MQTT_PAYLOAD_MAX
+ * are rejected.
  * *********************************************************************************** */
 void mqttCallback ( char* topic, byte* payload, unsigned int length) {
-    payload[length] = (char)0;
-    memcpy( (char*)buffer, (char*)payload, length);
-    buffer[length] = (char)0;
-    boolean match = false;
-    
-    PRINTLN("MQTT Callback");
-
-    if ( strlen(topic) > strlen(inTopic)-1) {
-        char *command=topic+strlen(inTopic)-1;
-
-        PRINT("Received MQTT command: <"); PRINT(command); PRINTLN(">");
-        
-        for ( int index = 0; mqttServiceList[index].name != NULL; index++ ) {
+    unsigned int topicLen = strlen(topic);
 
-            PRINT("Checking for servive <");PRINT(mqttServiceList[index].name);PRINTLN(">");
-
-            if ( !strncmp(mqttServiceList[index].name, command, strlen(mqttServiceList[index].name))) {
-                match = true;
+    if ( length > MQTT_PAYLOAD_MAX ) {
+        MqttOversize++;
+        LOG_WARN(LOG_MQTT_OVERSIZE, topicLen, length);
+        return;
+    }
 
-                PRINTLN("Found match!");
+    if ( topicLen > inTopicLen ) {
+        const char *command = topic + inTopicLen;
+        unsigned int commandLen = topicLen - inTopicLen;
 
-                if (mqttServiceList[index].handler) {
-                    (mqttServiceList[index].handler)(buffer);
+        for ( int index = 0; index < routeCount; index++ ) {
+            if ( routeLen[index] == commandLen && !memcmp(mqttServiceList[index].name, command, commandLen) ) {
+                LOG_DEBUG(LOG_MQTT_RX, index, length);
+                if ( mqttServiceList[index].handler ) {
+                    (mqttServiceList[index].handler)((const char*)payload, length);
                 }
+                return;
             }
         }
-        
-        if ( !match ) {
-            PRINTLN("ERROR: Received unknown MQTT command" );
-        }
     }
-}
\ No newline at end of file
+    MqttUnknown++;
+    LOG_WARN(LOG_MQTT_UNKNOWN, topicLen, length);
+}
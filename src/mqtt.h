@@ -27,20 +27,54 @@
 #define MQTT_BROKER "192.168.100.26"
 #define MQTT_PORT   1883
 
+#define MQTT_MAX_SERVICES   8   // entries in mqttServiceList
+#define MQTT_PAYLOAD_MAX  128   // longer incoming messages are rejected
+
+/* *********************************************************************************** *
+ * Outbound queue                                                                      *
+ * *********************************************************************************** */
+#define MQTT_QUEUE_LEN     12   // messages waiting to be published
+#define MQTT_MSG_LEN      320   // longest message including the terminating zero (telemetry frames)
+#define MQTT_TOPIC_LEN     64   // longest topic including the terminating zero
+#define MQTT_PACKET_LEN   (MQTT_MSG_LEN + MQTT_TOPIC_LEN + 8)   // PubSubClient buffer: header, topic and message
+#define MQTT_FLUSH_MAX      4   // messages published per call of mqttFlush()
+
+#define MQTT_PRIO_DEBUG     0   // /Debug and /Log, dropped first
+#define MQTT_PRIO_TELEMETRY 1   // /Telemetry, batches of samples are never replaced
+#define MQTT_PRIO_STATUS    2   // everything else
+#define MQTT_PRIO_ERROR     3   // /Error and /BlackBox, dropped last
+#define MQTT_NUM_PRIO       4
+
+#define MQTT_COALESCE_NONE      0   // every message is published
+#define MQTT_COALESCE_HEARTBEAT 1   // a new heartbeat replaces a queued one
+
 /* *********************************************************************************** *
  * Custom Types                                                                        *
  * *********************************************************************************** */
 typedef struct {     // struct specifing a callback function fot a specific MQTT topic
     const char* name;
-    void (*handler)(const char*);
+    void (*handler)(const char* payload, unsigned int length);  // payload is not zero terminated
 } service_t;
 
 /* ********************************************************************************** * 
  * Prototypes                                                                         * 
  * ********************************************************************************** */
-bool initMQTT(void);                                    // initialize mqtt communication
+bool initMQTT(void);                                    // one attempt to connect to the broker
 
 bool mqttDebug( const char* message );                   // send Debug message over MQTT
 bool mqttSendMessage( const char* topicFmt, const char* message );  // send MQTT message 
+bool mqttSendMessage( const char* topicFmt, const char* message, byte coalesce );  // replace a queued message of the same source
+bool mqttSendData( const char* topicFmt, const byte* data, unsigned int length ); // send binary MQTT message
+bool mqttSendData( const char* topicFmt, const byte* data, unsigned int length, byte coalesce ); // ... replacing a queued one of the same source
+void mqttFlush(void);                                    // publish queued messages (call in loop)
+
+extern unsigned int  MqttQueueDepth;                     // messages currently queued
+extern unsigned int  MqttQueuePeak;                      // highest queue depth seen
+extern unsigned long MqttDropped[MQTT_NUM_PRIO];         // messages dropped per priority
+extern unsigned long MqttLatencyMax;                     // longest time in ms a message was queued
+extern unsigned long MqttLatencyAvg;                     // moving average of the time queued
+extern unsigned long MqttReconnects;                     // connections to the broker after the first
+extern unsigned long MqttOversize;                       // incoming messages rejected for their size
+extern unsigned long MqttUnknown;                        // incoming messages without a matching service
 
 #endif
\ No newline at end of file
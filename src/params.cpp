@@ -0,0 +1,311 @@
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Runtime tunable gait parameters                                                    */
+/*                                                                                     */
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Copyright 2024 by Bodo Bauer <bb@bb-zone.com>                                      */
+/*                                                                                     */
+/*  This program is free software: you can redistribute it and/or modify               */
+/*  it under the terms of the GNU General Public License as published by               */
+/*  the Free Software Foundation, either version 3 of the License, or                  */
+/*  (at your option) any later version.                                                */
+/*                                                                                     */
+/*  This program is distributed in the hope that it will be useful,                    */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of                     */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                      */
+/*  GNU General Public License for more details.                                       */
+/*                                                                                     */
+/*  You should have received a copy of the GNU General Public License                  */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.              */
+#include <Arduino.h>
+#include <stddef.h>
+#include "params.h"
+#include "persistence.h"
+#include "legs.h"
+#include "hexabot.h"
+
+/* *********************************************************************************** *
+ * The gaits read their timing and geometry from GaitParams, a plain struct, so reading a
+ * parameter is a single load. Changes are staged and only take effect between two gait
+ * cycles: a gait reaching the end of its cycle asks gaitCycleBoundary() and holds while
+ * staged parameters are waiting, the motion task then applies all of them at once (see
+ * updateGaitParams()). This way a cycle never runs with a mix of old and new values.
+ * *********************************************************************************** */
+
+typedef struct {
+  const char *name;
+  uint16_t    offset;            // within gaitparams_t
+  int16_t     value;             // default
+  int16_t     min;
+  int16_t     max;
+  const char *unit;
+} paramdef_t;
+
+#define PARAM(field) offsetof(gaitparams_t, field)
+
+const paramdef_t ParamDef[] = {
+  { "TripodCycleTime", PARAM(tripodCycleTime),  750, 200, 5000, "ms"  },
+  { "RippleCycleTime", PARAM(rippleCycleTime), 1000, 200, 5000, "ms"  },
+  { "QuadCycleTime",   PARAM(quadCycleTime),    600, 200, 5000, "ms"  },
+  { "WaveCycleTime",   PARAM(waveCycleTime),    900, 200, 5000, "ms"  },
+  { "CrabCycleTime",   PARAM(crabCycleTime),   1000, 200, 5000, "ms"  },
+  { "HipSwing",        PARAM(hipSwing),          25,   0,   80, "deg" },  // tripod, quad and scamper
+  { "RippleHipSwing",  PARAM(rippleHipSwing),    25,   0,   80, "deg" },
+  { "FbShift",         PARAM(fbShift),           15,   0,   45, "deg" },  // front legs back, back legs forward
+  { "TurnShift",       PARAM(turnShift),         40,   0,   60, "deg" },
+  { "QuadShift",       PARAM(quadShift),         25,   0,   60, "deg" },
+  { "TripodKneeUp",    PARAM(tripodKneeUp),      50,   0,  180, "deg" },
+  { "TripodKneeAdj",   PARAM(tripodKneeAdj),     30,   0,   90, "deg" },  // added per submode speed factor
+  { "ScamperKneeUp",   PARAM(scamperKneeUp),     70,   0,  180, "deg" },
+  { "RippleKneeUp",    PARAM(rippleKneeUp),      70,   0,  180, "deg" },
+  { "QuadKneeLift",    PARAM(quadKneeLift),      30,   0,  150, "deg" },
+  { "WaveKnee",        PARAM(waveKnee),          60,   0,  180, "deg" },
+  { "CrabStride",      PARAM(crabStride),        40,   0,  100, "mm"  },
+  { "CrabLift",        PARAM(crabLift),          20,   0,   50, "mm"  },
+  { "TripodLiftWeight",  PARAM(tripodLiftWeight),  0, 0, 1000, ""  },  // 0: from the servo speed model
+  { "TripodPushWeight",  PARAM(tripodPushWeight),  0, 0, 1000, ""  },
+  { "TripodLowerWeight", PARAM(tripodLowerWeight), 0, 0, 1000, ""  },
+  { "RippleLiftWeight",  PARAM(rippleLiftWeight),  0, 0, 1000, ""  },
+  { "RippleSwingWeight", PARAM(rippleSwingWeight), 0, 0, 1000, ""  },
+  { "RippleLowerWeight", PARAM(rippleLowerWeight), 0, 0, 1000, ""  },
+  { "RipplePushWeight",  PARAM(ripplePushWeight),  0, 0, 1000, ""  },
+  { "QuadLiftWeight",    PARAM(quadLiftWeight),    0, 0, 1000, ""  },
+  { "QuadPushWeight",    PARAM(quadPushWeight),    0, 0, 1000, ""  },
+  { "QuadLowerWeight",   PARAM(quadLowerWeight),   0, 0, 1000, ""  },
+};
+
+static_assert(sizeof(ParamDef)/sizeof(ParamDef[0]) == NUM_GAIT_PARAMS, "every gait parameter needs a definition");
+static_assert(GAIT_PROFILE_OFFSET + sizeof(gaitconfig_t) <= sizeof(((storage_t*)0)->userdata), "gait profiles do not fit into the userdata");
+
+gaitparams_t         GaitParams;
+static gaitparams_t  staged;             // parameters waiting for a cycle boundary
+static bool          pending    = false;
+static bool          boundary   = false;  // a gait holds at the end of its cycle
+static unsigned long pendingSince = 0;
+
+#define PARAM_VALUE(params, i)  (*(int16_t*)((byte*)(params) + ParamDef[i].offset))
+
+/* *********************************************************************************** */
+/* @brief Index of a parameter by name, -1 if unknown                                  */
+/* *********************************************************************************** */
+int gaitParamIndex(const char *name) {
+  for (unsigned int i = 0; i < NUM_GAIT_PARAMS; i++) {
+    if (!strcmp(name, ParamDef[i].name)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* *********************************************************************************** */
+/* @brief Staged parameters, starting from the ones in effect                          */
+/* *********************************************************************************** */
+gaitparams_t* stagedGaitParams(void) {
+  if (!pending) {
+    staged       = GaitParams;
+    pending      = true;
+    pendingSince = millis();
+  }
+  return &staged;
+}
+
+/* *********************************************************************************** */
+/* @brief Copy the values of a profile into a parameter set, within their bounds       */
+/* *********************************************************************************** */
+void profileToParams(const gaitprofile_t *profile, gaitparams_t *params) {
+  for (unsigned int i = 0; i < NUM_GAIT_PARAMS; i++) {
+    PARAM_VALUE(params, i) = constrain(profile->value[i], ParamDef[i].min, ParamDef[i].max);
+  }
+}
+
+/* *********************************************************************************** *
+ * @brief Find a profile in the config store
+ *
+ * @retval the profile, NULL if there is none with this name
+ * *********************************************************************************** */
+gaitprofile_t* findGaitProfile(gaitconfig_t *config, const char *name) {
+  if (strncmp(config->magic, GAIT_PROFILE_MAGIC, sizeof(config->magic)) || config->count != NUM_GAIT_PARAMS) {
+    return NULL;
+  }
+  for (int i = 0; i < GAIT_PROFILES; i++) {
+    if (!strncmp(config->profile[i].name, name, GAIT_PROFILE_NAME)) {
+      return &config->profile[i];
+    }
+  }
+  return NULL;
+}
+
+/* *********************************************************************************** *
+ * @brief Initialize the gait parameters
+ *
+ * Needs to be called after loadFromEEPROM(). Starts with the defaults, a profile named 
+ * GAIT_PROFILE_BOOT replaces them.
+ * *********************************************************************************** */
+void loadGaitParams(void) {
+  gaitconfig_t config;
+  memcpy(&config, persistentData.userdata + GAIT_PROFILE_OFFSET, sizeof(config));
+
+  for (unsigned int i = 0; i < NUM_GAIT_PARAMS; i++) {
+    PARAM_VALUE(&GaitParams, i) = ParamDef[i].value;
+  }
+  gaitprofile_t *profile = findGaitProfile(&config, GAIT_PROFILE_BOOT);
+  if (profile) {
+    profileToParams(profile, &GaitParams);
+  }
+}
+
+/* *********************************************************************************** *
+ * @brief Stage a new value for a parameter, it takes effect at the next cycle boundary
+ *
+ * @retval 'false'  if the parameter is unknown or the value out of bounds
+ * *********************************************************************************** */
+bool setGaitParam(const char *name, int value) {
+  int i = gaitParamIndex(name);
+  if (i < 0 || value < ParamDef[i].min || value > ParamDef[i].max) {
+    return false;
+  }
+  PARAM_VALUE(stagedGaitParams(), i) = value;
+  return true;
+}
+
+/* *********************************************************************************** *
+ * @brief Describe a parameter: name, value in effect, bounds and unit
+ *
+ * @retval 'false'  if the parameter is unknown
+ * *********************************************************************************** */
+bool getGaitParam(const char *name, char *text, unsigned int size) {
+  int i = gaitParamIndex(name);
+  if (i < 0) {
+    return false;
+  }
+  snprintf(text, size, "%s %d (%d..%d %s)%s", ParamDef[i].name, PARAM_VALUE(&GaitParams, i),
+           ParamDef[i].min, ParamDef[i].max, ParamDef[i].unit, pending ? " pending" : "");
+  return true;
+}
+
+/* *********************************************************************************** */
+/* @brief Values of all parameters in effect, in the order of the registry             */
+/* *********************************************************************************** */
+void getGaitParams(char *text, unsigned int size) {
+  unsigned int length = 0;
+  text[0] = 0;
+  for (unsigned int i = 0; i < NUM_GAIT_PARAMS && length < size; i++) {
+    length += snprintf(text + length, size - length, i ? " %d" : "%d", PARAM_VALUE(&GaitParams, i));
+  }
+}
+
+/* *********************************************************************************** */
+/* @brief Stage the default values of all parameters                                   */
+/* *********************************************************************************** */
+void resetGaitParams(void) {
+  gaitparams_t *params = stagedGaitParams();
+  for (unsigned int i = 0; i < NUM_GAIT_PARAMS; i++) {
+    PARAM_VALUE(params, i) = ParamDef[i].value;
+  }
+}
+
+/* *********************************************************************************** *
+ * @brief Save the parameters as a named profile in the config store
+ *
+ * Values still staged are saved along with the ones in effect, so a profile set up with
+ * SetParam can be saved right away while the robot walks. A profile with the same name 
+ * is replaced, otherwise a free slot is used. Profiles saved with a different set of 
+ * parameters are discarded. The flash is written by loop() (see deferSaveToEEPROM()), 
+ * the motion task must not block on it.
+ *
+ * @retval 'false'  if there is no free slot
+ * *********************************************************************************** */
+bool saveGaitProfile(const char *name) {
+  gaitconfig_t config;
+  memcpy(&config, persistentData.userdata + GAIT_PROFILE_OFFSET, sizeof(config));
+
+  if (strncmp(config.magic, GAIT_PROFILE_MAGIC, sizeof(config.magic)) || config.count != NUM_GAIT_PARAMS) {
+    memset(&config, 0, sizeof(config));
+    strncpy(config.magic, GAIT_PROFILE_MAGIC, sizeof(config.magic));
+    config.count = NUM_GAIT_PARAMS;
+  }
+  gaitprofile_t *profile = findGaitProfile(&config, name);
+  if (!profile) {
+    profile = findGaitProfile(&config, "");    // free slot
+  }
+  if (!profile || !name[0]) {
+    return false;
+  }
+  memset(profile->name, 0, sizeof(profile->name));
+  strncpy(profile->name, name, GAIT_PROFILE_NAME-1);
+  const gaitparams_t *params = pending ? &staged : &GaitParams;
+  for (unsigned int i = 0; i < NUM_GAIT_PARAMS; i++) {
+    profile->value[i] = PARAM_VALUE(params, i);
+  }
+  memcpy(persistentData.userdata + GAIT_PROFILE_OFFSET, &config, sizeof(config));
+  deferSaveToEEPROM();
+  return true;
+}
+
+/* *********************************************************************************** *
+ * @brief Stage the parameters of a named profile
+ *
+ * @retval 'false'  if there is no such profile
+ * *********************************************************************************** */
+bool loadGaitProfile(const char *name) {
+  gaitconfig_t config;
+  memcpy(&config, persistentData.userdata + GAIT_PROFILE_OFFSET, sizeof(config));
+
+  gaitprofile_t *profile = name[0] ? findGaitProfile(&config, name) : NULL;
+  if (!profile) {
+    return false;
+  }
+  profileToParams(profile, stagedGaitParams());
+  return true;
+}
+
+/* *********************************************************************************** *
+ * @brief Called by the gaits at the end of their cycle
+ *
+ * @retval 'true'   if parameters are waiting, the gait has to hold until they have been
+ *                  applied by the motion task
+ * *********************************************************************************** */
+bool gaitCycleBoundary(void) {
+  if (pending) {
+    boundary = true;
+  }
+  return pending;
+}
+
+/* *********************************************************************************** *
+ * @brief Time in ms of a cycle of the gait of a mode, with the parameters in effect
+ *
+ * Returns 0 for gaits without a fixed cycle time (scamper ends its phases on arrival).
+ * *********************************************************************************** */
+long gaitCycleTime(byte mode, byte submode) {
+  switch (mode) {
+    case MODE_WALK:   return (submode == SUBMODE_4) ? 0 : 
+                             GaitParams.tripodCycleTime * ((submode == SUBMODE_2) ? 2L : 1L);
+    case MODE_RIPPLE: return GaitParams.rippleCycleTime;
+    case MODE_QUAD:   return GaitParams.quadCycleTime;
+    case MODE_WAVE:   return GaitParams.waveCycleTime;
+    case MODE_CRAB:   return GaitParams.crabCycleTime;
+  }
+  return 0;
+}
+
+/* *********************************************************************************** *
+ * @brief Apply the staged parameters (motion task, before running the gait)
+ *
+ * They are applied once the running gait holds at the end of its cycle or right away 
+ * when the robot does not walk. As a safety net, e.g. for a gait stuck in a phase, they
+ * are applied anyway after a full cycle plus PARAMS_APPLY_TIMEOUT. The frame cache is 
+ * cleared as its frames were computed with the old values.
+ * *********************************************************************************** */
+void updateGaitParams(bool moving, long cycletime) {
+  if (!pending) {
+    return;
+  }
+  if (!moving || boundary || (long)(millis() - pendingSince) >= cycletime + PARAMS_APPLY_TIMEOUT) {
+    GaitParams = staged;
+    pending    = false;
+    boundary   = false;
+    invalidateFrames();
+  }
+}
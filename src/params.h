@@ -0,0 +1,108 @@
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Runtime tunable gait parameters                                                    */
+/*                                                                                     */
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Copyright 2024 by Bodo Bauer <bb@bb-zone.com>                                      */
+/*                                                                                     */
+/*  This program is free software: you can redistribute it and/or modify               */
+/*  it under the terms of the GNU General Public License as published by               */
+/*  the Free Software Foundation, either version 3 of the License, or                  */
+/*  (at your option) any later version.                                                */
+/*                                                                                     */
+/*  This program is distributed in the hope that it will be useful,                    */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of                     */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                      */
+/*  GNU General Public License for more details.                                       */
+/*                                                                                     */
+/*  You should have received a copy of the GNU General Public License                  */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.              */
+#include <Arduino.h>
+
+#ifndef PARAMS_H
+#define PARAMS_H
+
+/* *********************************************************************************** */
+/* Gait parameter settings                                                             */
+/* *********************************************************************************** */
+
+#define GAIT_PROFILE_MAGIC   "GPAR01"   // marks valid gait profiles in the config store
+#define GAIT_PROFILE_OFFSET    128      // gait profiles follow the servo profiles in the userdata
+#define GAIT_PROFILES            4      // named profiles kept in the config store
+#define GAIT_PROFILE_NAME       12      // longest profile name including the terminating zero
+#define GAIT_PROFILE_BOOT   "boot"      // profile loaded at power up
+#define PARAMS_APPLY_TIMEOUT  2000      // ms to wait on top of a cycle for its boundary before applying anyway
+
+/* *********************************************************************************** */
+/* Custom Types                                                                        */
+/* *********************************************************************************** */
+
+typedef struct {                 // parameters read by the gaits, see ParamDef in params.cpp
+  int16_t tripodCycleTime;
+  int16_t rippleCycleTime;
+  int16_t quadCycleTime;
+  int16_t waveCycleTime;
+  int16_t crabCycleTime;
+  int16_t hipSwing;
+  int16_t rippleHipSwing;
+  int16_t fbShift;
+  int16_t turnShift;
+  int16_t quadShift;
+  int16_t tripodKneeUp;
+  int16_t tripodKneeAdj;
+  int16_t scamperKneeUp;
+  int16_t rippleKneeUp;
+  int16_t quadKneeLift;
+  int16_t waveKnee;
+  int16_t crabStride;
+  int16_t crabLift;
+  int16_t tripodLiftWeight;      // phase weights, 0 derives them from the servo speed model
+  int16_t tripodPushWeight;
+  int16_t tripodLowerWeight;
+  int16_t rippleLiftWeight;
+  int16_t rippleSwingWeight;
+  int16_t rippleLowerWeight;
+  int16_t ripplePushWeight;
+  int16_t quadLiftWeight;
+  int16_t quadPushWeight;
+  int16_t quadLowerWeight;
+} gaitparams_t;
+
+#define NUM_GAIT_PARAMS  (sizeof(gaitparams_t)/sizeof(int16_t))
+
+typedef struct {                 // a named set of parameters as kept in the config store
+  char    name[GAIT_PROFILE_NAME];
+  int16_t value[NUM_GAIT_PARAMS];
+} gaitprofile_t;
+
+typedef struct {                 // gait profiles as kept in the config store
+  char          magic[8];
+  uint16_t      count;           // parameters per profile when saved
+  gaitprofile_t profile[GAIT_PROFILES];
+} gaitconfig_t;
+
+/* *********************************************************************************** */
+/* Exported globals                                                                    */
+/* *********************************************************************************** */
+
+extern gaitparams_t GaitParams;       // in effect, the gaits read these directly
+
+/* *********************************************************************************** */
+/* Prototypes                                                                          */
+/* *********************************************************************************** */
+
+void loadGaitParams(void);            // defaults and the boot profile, after loadFromEEPROM()
+
+// motion context
+bool setGaitParam(const char *name, int value);
+bool getGaitParam(const char *name, char *text, unsigned int size);
+void getGaitParams(char *text, unsigned int size);
+void resetGaitParams(void);
+bool saveGaitProfile(const char *name);
+bool loadGaitProfile(const char *name);
+bool gaitCycleBoundary(void);         // gaits: true if they should hold for new parameters
+long gaitCycleTime(byte mode, byte submode);  // ms of a cycle of a gait, 0 if it has no fixed cycle
+void updateGaitParams(bool moving, long cycletime);  // motion task: apply staged parameters
+
+#endif
@@ -26,6 +26,7 @@
 /* Global variables                                                                    */
 /* *********************************************************************************** */
 storage_t persistentData;
+bool      SavePending = false;   // persistentData changed, to be written by loop()
 
 /* *********************************************************************************** */
 /*  @brief Load persistent data from EEPROM                                            */
@@ -33,10 +34,11 @@ storage_t persistentData;
 bool loadFromEEPROM(void) {
     char *dest = (char *)&persistentData;
     
+    EEPROM.begin(EEPROM_SIZE);
+
     // copy data from EEPROM into data struct;
-    for (int address = 0; address<EEPROM_SIZE; address++) {
+    for (unsigned int address = 0; address<sizeof(storage_t); address++) {
         *dest = EEPROM.read(address);
-        address++;
         dest++;
     }
 
@@ -50,11 +52,32 @@ bool loadFromEEPROM(void) {
 bool saveToEEPROM(void) {
     char *src = (char *)&persistentData;
     
-    // copy data from EEPROM into data struct;
-    for (int address = 0; address<EEPROM_SIZE; address++) {
+    // copy data struct into EEPROM;
+    for (unsigned int address = 0; address<sizeof(storage_t); address++) {
         EEPROM.write(address, *src);
-        address++;
         src++;
     }
     return EEPROM.commit();
 }
+
+/* *********************************************************************************** */
+/*  @brief Have persistent data saved by loop(), for use from the motion task          */
+/*                                                                                     */
+/*  Writing the flash blocks for tens of ms, which must not happen in a Ticker.        */
+/* *********************************************************************************** */
+void deferSaveToEEPROM(void) {
+    SavePending = true;
+}
+
+/* *********************************************************************************** */
+/*  @brief Save persistent data if a save has been deferred (loop)                     */
+/*                                                                                     */
+/*  @retval 'false' if saving failed                                                   */
+/* *********************************************************************************** */
+bool saveDeferredToEEPROM(void) {
+    if (!SavePending) {
+        return true;
+    }
+    SavePending = false;
+    return saveToEEPROM();
+}
@@ -53,5 +53,7 @@ extern storage_t persistentData;
 /* *********************************************************************************** */
 bool loadFromEEPROM(void);                        // load persistent data from EEPROM
 bool saveToEEPROM(void);                          // save persistent data to EEPROM
+void deferSaveToEEPROM(void);                     // save from loop(), for the motion task
+bool saveDeferredToEEPROM(void);                  // loop: run a deferred save
 
 #endif
\ No newline at end of file
@@ -34,7 +34,6 @@
 /* @brief put bot in a neutral stading position position                               */
 /* *********************************************************************************** */
 void stand() {
-  transactServos();
   setLeg(ALL_LEGS, HIP_NEUTRAL, KNEE_STAND, 0);
   commitServos(); 
 }
@@ -43,7 +42,6 @@ void stand() {
 /* @brief Used to install servos, sets all servos to 90 degrees                        */
 /* *********************************************************************************** */
 void stand_90_degrees() {
-  transactServos();
   setLeg(ALL_LEGS, 90, 90, 0);
   commitServos();
 }
@@ -53,6 +51,7 @@ void stand_90_degrees() {
 /* *********************************************************************************** */
 void laydown() {
   setLeg(ALL_LEGS, HIP_NEUTRAL, KNEE_UP, 0);
+  commitServos();
 }
 
 /* *********************************************************************************** */
@@ -62,6 +61,7 @@ void foldup() {
   setLeg(ALL_LEGS, NOMOVE, KNEE_FOLD, 0);
   for (int i = 0; i < NUM_LEGS; i++) 
         setHipRaw(i, HIP_FOLD);
+  commitServos();
 }
 
 /* *********************************************************************************** */
@@ -69,6 +69,7 @@ void foldup() {
 /* *********************************************************************************** */
 void tiptoes() {
   setLeg(ALL_LEGS, HIP_NEUTRAL, KNEE_TIPTOES, 0);
+  commitServos();
 }
 
 /* *********************************************************************************** */
@@ -102,4 +103,5 @@ void flutter() {
       setLeg(TRIPOD1_LEGS, NOMOVE, KNEE_TIPTOES, 0, 0);
       break;
   }
+  commitServos();
 }
\ No newline at end of file
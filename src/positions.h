@@ -28,6 +28,7 @@
 /*  along with this program.  If not, see <http://www.gnu.org/licenses/>.              */
 /* *********************************************************************************** */
 #include "legs.h"
+#include "params.h"
 
 #ifndef POSITIONS_H
 #define POSITIONS_H
@@ -80,12 +81,12 @@
 #define KNEE_DOWN    30   
 #define KNEE_TIPTOES  5
 #define KNEE_FOLD   175
-#define KNEE_SCAMPER (KNEE_NEUTRAL-20)
-#define KNEE_TRIPOD_UP (KNEE_NEUTRAL-40)
-#define KNEE_TRIPOD_ADJ 30
+#define KNEE_SCAMPER (GaitParams.scamperKneeUp)     // gait parameters, see params.cpp
+#define KNEE_TRIPOD_UP (GaitParams.tripodKneeUp)
+#define KNEE_TRIPOD_ADJ (GaitParams.tripodKneeAdj)
 #define TWITCH_ADJ 60
 
-#define HIPSWING 25      // how far to swing hips on gaits like tripod or quadruped
+#define HIPSWING (GaitParams.hipSwing)  // how far to swing hips on gaits like tripod or quadruped
 #define HIPSMALLSWING 10  // when in fine adjust mode how far to move hips
 
 #define HIP_NEUTRAL 90
@@ -97,7 +98,7 @@
 #define HIP_BACKWARD_MAX 0
 #define HIP_FOLD 150
 
-#define TRIPOD_CYCLE_TIME 750
+#define TRIPOD_CYCLE_TIME (GaitParams.tripodCycleTime)
 #define FIGHT_CYCLE_TIME 660
 
 /* *********************************************************************************** */
@@ -0,0 +1,83 @@
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Stackless coroutines for motion programs                                           */
+/*                                                                                     */
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Copyright 2024 by Bodo Bauer <bb@bb-zone.com>                                      */
+/*                                                                                     */
+/*  This program is free software: you can redistribute it and/or modify               */
+/*  it under the terms of the GNU General Public License as published by               */
+/*  the Free Software Foundation, either version 3 of the License, or                  */
+/*  (at your option) any later version.                                                */
+/*                                                                                     */
+/*  This program is distributed in the hope that it will be useful,                    */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of                     */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                      */
+/*  GNU General Public License for more details.                                       */
+/*                                                                                     */
+/*  You should have received a copy of the GNU General Public License                  */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.              */
+#include <Arduino.h>
+#include "legs.h"
+
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+/* *********************************************************************************** *
+ * Motion programs are plain functions that are called on every motion tick and pick up
+ * where they left off, in the manner of protothreads. Instead of computing a phase from
+ * the clock, a program sets some legs and then waits for something to happen:
+ *
+ *   void gait(..., program_t *p) {
+ *     PROGRAM_BEGIN(p);
+ *     for (;;) {
+ *       setLeg(...);
+ *       PROGRAM_AWAIT_ARRIVAL(p, 100, 200);   // until the servos arrived, at most 200ms
+ *       setLeg(...);
+ *       PROGRAM_SLEEP(p, 50);
+ *     }
+ *     PROGRAM_END(p);
+ *   }
+ *
+ * Local variables do not survive a wait, keep loop counters in the program_t. Waits
+ * must not be placed inside a switch statement of the program itself.
+ * *********************************************************************************** */
+
+typedef struct {
+  unsigned int  line;            // where to resume, 0 = from the start
+  unsigned long since;           // hexmillis() when the current wait started
+  byte          command;         // command the program was last resumed with
+  bool          changed;         // the command changed during the current wait
+  int           counter;         // for loops spanning waits
+} program_t;
+
+// resume the program, tell it about the current command
+#define PROGRAM_RESUME(p, cmd)   do { if ((cmd) != (p)->command) { (p)->command = (cmd); (p)->changed = true; } } while (0)
+
+#define PROGRAM_BEGIN(p)         switch ((p)->line) { case 0:
+#define PROGRAM_END(p)           } (p)->line = 0
+#define PROGRAM_RESTART(p)       do { (p)->line = 0; return; } while (0)
+
+// time in ms since the current wait started
+#define PROGRAM_ELAPSED(p)       ((long)(hexmillis() - (p)->since))
+
+// return to the caller until cond holds, resume here with the next call. A wait always
+// yields at least once so that every step gets committed and a program whose
+// conditions all hold can not spin within one tick
+#define PROGRAM_AWAIT(p, cond)                                      \
+  (p)->line = __LINE__; (p)->since = hexmillis(); (p)->changed = false; return; \
+  case __LINE__: if (!(cond)) return
+
+// if cond holds, wait until it does not anymore, nothing happens otherwise
+#define PROGRAM_HOLD(p, cond)             if (cond) { PROGRAM_AWAIT(p, !(cond)); }
+
+#define PROGRAM_SLEEP(p, ms)              PROGRAM_AWAIT(p, PROGRAM_ELAPSED(p) >= (ms))
+#define PROGRAM_AWAIT_COMMAND(p)          PROGRAM_AWAIT(p, (p)->changed)
+
+// wait until the servos made percent of their moves, but no longer than maxms or until
+// the command changes
+#define PROGRAM_AWAIT_ARRIVAL(p, percent, maxms) \
+  PROGRAM_AWAIT(p, servosRemaining(percent) == 0 || PROGRAM_ELAPSED(p) >= (maxms) || (p)->changed)
+
+#endif
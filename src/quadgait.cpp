@@ -32,12 +32,12 @@
 #include "quadgait.h"
 #include "hexabot.h"
 
-#define FBSHIFT_QUAD 25
+#define FBSHIFT_QUAD (GaitParams.quadShift)
 #define HIP_FORWARD_QUAD (HIP_FORWARD)
 #define HIP_BACKWARD_QUAD (HIP_BACKWARD)
-#define KNEE_QUAD_UP (KNEE_DOWN+30)
+#define KNEE_QUAD_UP (KNEE_DOWN+GaitParams.quadKneeLift)
 #define KNEE_QUAD_DOWN (KNEE_DOWN)
-#define QUAD_CYCLE_TIME 600
+#define QUAD_CYCLE_TIME (GaitParams.quadCycleTime)
 #define NUM_QUAD_PHASES 6
 
 /* *********************************************************************************** *
@@ -74,11 +74,10 @@ void walkQuadGait(byte command) {
 /* *********************************************************************************** *
  * @brief walk with middle legs raied up 
  *
- * The gait walks using a quadruped gait with middle legs raised up. This code 
- * determines what phase we are currently in by using the millis clock modulo the 
- * desired time period that all phases should consume. Right now each phase is an 
- * equal amount of time but this may not be optimalProcess walking commands in 
- * Tripod Gait manner
+ * The gait walks using a quadruped gait with middle legs raised up. A phase ends as 
+ * soon as the servos are predicted to have reached their positions, but never takes
+ * longer than its share of the desired time period (see gaitPhase()). Knee phases
+ * get less time than hip phases, see phaseWeights().
  * *********************************************************************************** */
 void gait_quad(int turn, int reverse, int hipforward, int hipbackward, int kneeup, int kneedown, long timeperiod, int leanangle) {
 
@@ -92,10 +91,22 @@ void gait_quad(int turn, int reverse, int hipforward, int hipbackward, int kneeu
         hipbackward = tmp;
     }
 
-    long t = hexmillis()%timeperiod;
-    long phase = (NUM_QUAD_PHASES*t)/timeperiod;
+    static const byte kinds[NUM_QUAD_PHASES] = { PHASE_LIFT, PHASE_PUSH, PHASE_LOWER, 
+                                                 PHASE_LIFT, PHASE_PUSH, PHASE_LOWER };
+    const int16_t configured[NUM_PHASE_KINDS] = { GaitParams.quadLiftWeight, 0, 
+                                                  GaitParams.quadLowerWeight, GaitParams.quadPushWeight };
+    long weight[NUM_PHASE_KINDS];
+    static phasetiming_t quadTiming;
+    phaseWeights(weight, configured, kneeup - kneedown, hipforward - hipbackward);
+    setPhaseTiming(&quadTiming, kinds, NUM_QUAD_PHASES, weight);
+
+    static gaitphase_t quadPhase = {0, 0};
+    long phase = gaitPhase(&quadPhase, &quadTiming, timeperiod);
+    if (frameCached(phase)) {
+        commitServos();
+        return;
+    }
 
-    transactServos();
     setLeg(MIDDLE_LEGS, HIP_NEUTRAL, KNEE_UP_MAX, FBSHIFT_QUAD, 0);
   
     switch (phase) {
@@ -140,5 +151,6 @@ void gait_quad(int turn, int reverse, int hipforward, int hipbackward, int kneeu
             setLeg(QUAD2_LEGS, NOMOVE, kneedown, 0, turn);
             break;  
     }
+    cacheFrame(phase);
     commitServos();
 }
\ No newline at end of file
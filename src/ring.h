@@ -0,0 +1,93 @@
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Lock-free single producer / single consumer ring buffer                            */
+/*                                                                                     */
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Copyright 2024 by Bodo Bauer <bb@bb-zone.com>                                      */
+/*                                                                                     */
+/*  This program is free software: you can redistribute it and/or modify               */
+/*  it under the terms of the GNU General Public License as published by               */
+/*  the Free Software Foundation, either version 3 of the License, or                  */
+/*  (at your option) any later version.                                                */
+/*                                                                                     */
+/*  This program is distributed in the hope that it will be useful,                    */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of                     */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                      */
+/*  GNU General Public License for more details.                                       */
+/*                                                                                     */
+/*  You should have received a copy of the GNU General Public License                  */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.              */
+#include <Arduino.h>
+
+#ifndef RING_H
+#define RING_H
+
+/* *********************************************************************************** *
+ * A ring of N slots (N a power of two) handing items from exactly one producer to
+ * exactly one consumer. The producer only ever writes head, the consumer only ever 
+ * writes tail, so neither side needs a lock or has to disable interrupts. Items are 
+ * filled and read in place:
+ *
+ *   producer: slot = ringClaim(&r);  ... fill slot ...  ringPublish(&r);
+ *   consumer: slot = ringPeek(&r);   ... use slot ...   ringRelease(&r);
+ * *********************************************************************************** */
+
+template <typename T, unsigned int N>
+struct ring_t {
+  static_assert((N & (N-1)) == 0, "ring size has to be a power of two");
+  T                     slot[N];
+  volatile unsigned int head;     // next slot to be published, written by the producer only
+  volatile unsigned int tail;     // next slot to be consumed, written by the consumer only
+};
+
+/* *********************************************************************************** */
+/* @brief Producer: get the next free slot, NULL if the ring is full                   */
+/* *********************************************************************************** */
+template <typename T, unsigned int N>
+inline T* ringClaim(ring_t<T,N> *r) {
+  if (r->head - r->tail >= N) {
+    return NULL;
+  }
+  return &r->slot[r->head & (N-1)];
+}
+
+/* *********************************************************************************** */
+/* @brief Producer: hand the claimed slot over to the consumer                         */
+/* *********************************************************************************** */
+template <typename T, unsigned int N>
+inline void ringPublish(ring_t<T,N> *r) {
+  __sync_synchronize();           // the slot has to be complete before head moves on
+  r->head = r->head + 1;
+}
+
+/* *********************************************************************************** */
+/* @brief Consumer: get the oldest published slot, NULL if the ring is empty           */
+/* *********************************************************************************** */
+template <typename T, unsigned int N>
+inline T* ringPeek(ring_t<T,N> *r) {
+  if (r->head == r->tail) {
+    return NULL;
+  }
+  __sync_synchronize();           // do not read the slot before head has been seen
+  return &r->slot[r->tail & (N-1)];
+}
+
+/* *********************************************************************************** */
+/* @brief Consumer: give the slot returned by ringPeek() back to the producer          */
+/* *********************************************************************************** */
+template <typename T, unsigned int N>
+inline void ringRelease(ring_t<T,N> *r) {
+  __sync_synchronize();           // done with the slot before the producer may reuse it
+  r->tail = r->tail + 1;
+}
+
+/* *********************************************************************************** */
+/* @brief Number of items waiting in the ring                                          */
+/* *********************************************************************************** */
+template <typename T, unsigned int N>
+inline unsigned int ringDepth(ring_t<T,N> *r) {
+  return r->head - r->tail;
+}
+
+#endif
@@ -31,35 +31,43 @@
 #include "positions.h"
 #include "ripplegait.h"
 #include "hexabot.h"
+#include "program.h"
 
 
 /* *********************************************************************************** *
  * local constants
  * *********************************************************************************** */
 
-#define KNEE_RIPPLE_UP (KNEE_NEUTRAL-20)
+#define KNEE_RIPPLE_UP (GaitParams.rippleKneeUp)
 #define KNEE_RIPPLE_DOWN (KNEE_DOWN)
 
 #define HIP_FORWARD_RIPPLE (HIP_NEUTRAL+HIPSWING_RIPPLE)
 #define HIP_BACKWARD_RIPPLE (HIP_NEUTRAL-HIPSWING_RIPPLE)
-#define HIPSWING_RIPPLE 25
+#define HIPSWING_RIPPLE (GaitParams.rippleHipSwing)
 
-#define FBSHIFT    15   // shift front legs back, back legs forward, this much
+#define FBSHIFT    (GaitParams.fbShift)   // shift front legs back, back legs forward, this much
 
-#define RIPPLE_CYCLE_TIME 1000
+#define RIPPLE_CYCLE_TIME (GaitParams.rippleCycleTime)
+#define NUM_RIPPLE_PHASES 19
 
 
 /* *********************************************************************************** *
- * local prototypes
+ * local prototypes and motion programs
  * *********************************************************************************** */
 
+static program_t rippleProgram = { 0, 0, COMMAND_NONE, false, 0 };
+static phasetiming_t rippleTiming;
+
 void gait_ripple(int turn, int reverse, int hipforward, int hipbackward, int kneeup, int kneedown, long timeperiod);
 void gait_ripple(int turn, int reverse, int hipforward, int hipbackward, int kneeup, int kneedown, long timeperiod, int leanangle);
+void ripplePhaseTiming(phasetiming_t *timing, int hipforward, int hipbackward, int kneeup, int kneedown);
 
 /* *********************************************************************************** *
  * @brief Process walking commands in Tripod Gait manner
  * *********************************************************************************** */
 void walkRippleGait(byte command) {
+    PROGRAM_RESUME(&rippleProgram, command);
+
     // process commands
     switch (command) {
         case COMMAND_FORWARD:
@@ -91,19 +99,44 @@ void walkRippleGait(byte command) {
 /* *********************************************************************************** *
  * @brief walk by lifting only one leg at a time (this version makes leanangle zero)
  * 
- * The gait consists of 19 phases. This code determines what phase we are currently
- * in by using the millis clock modulo the desired time period that all phases should
- * consume. Right now each phase is an equal amount of time but this may not be optimal
+ * The gait consists of 19 phases. A phase ends as soon as the servos are predicted to
+ * have reached their positions, but never takes longer than its share of the desired
+ * time period (see ripplePhaseTiming()), or when the command changes.
  * *********************************************************************************** */
 void gait_ripple(int turn, int reverse, int hipforward, int hipbackward, int kneeup, int kneedown, long timeperiod) {
   gait_ripple(turn, reverse, hipforward, hipbackward, kneeup, kneedown, timeperiod, 0);
 }
+
+/* *********************************************************************************** *
+ * @brief Share of the cycle time for each phase of the ripple gait
+ *
+ * Each leg is lifted, swung and put down, then all legs push the body. Knee phases get
+ * less time than hip phases, see phaseWeights().
+ * *********************************************************************************** */
+void ripplePhaseTiming(phasetiming_t *timing, int hipforward, int hipbackward, int kneeup, int kneedown) {
+  const int16_t configured[NUM_PHASE_KINDS] = { GaitParams.rippleLiftWeight,  GaitParams.rippleSwingWeight, 
+                                                GaitParams.rippleLowerWeight, GaitParams.ripplePushWeight };
+  byte kinds[NUM_RIPPLE_PHASES];
+  for (int leg = 0; leg < NUM_LEGS; leg++) {
+    kinds[3*leg]   = PHASE_LIFT;
+    kinds[3*leg+1] = PHASE_SWING;
+    kinds[3*leg+2] = PHASE_LOWER;
+  }
+  kinds[NUM_RIPPLE_PHASES-1] = PHASE_PUSH;
+
+  long weight[NUM_PHASE_KINDS];
+  phaseWeights(weight, configured, kneeup - kneedown, hipforward - hipbackward);
+  setPhaseTiming(timing, kinds, NUM_RIPPLE_PHASES, weight);
+}
+
 /* *********************************************************************************** *
  * @brief walk by lifting only one leg at a time
  * 
- * The gait consists of 19 phases. This code determines what phase we are currently
- * in by using the millis clock modulo the desired time period that all phases should
- * consume. Right now each phase is an equal amount of time but this may not be optimal
+ * The gait consists of 19 phases: each leg in turn is lifted, swung forward and put 
+ * down again, then all legs move backward at the hips. A phase ends as soon as the 
+ * servos are predicted to have reached their positions, but never takes longer than 
+ * its share of the desired time period (see ripplePhaseTiming()), or when the command 
+ * changes. The servo frame is committed by the motion task.
  * *********************************************************************************** */
 void gait_ripple(int turn, int reverse, int hipforward, int hipbackward, int kneeup, int kneedown, long timeperiod, int leanangle) {
   if (turn) {
@@ -115,34 +148,31 @@ void gait_ripple(int turn, int reverse, int hipforward, int hipbackward, int kne
     hipbackward = tmp;
   }
 
-#define NUM_RIPPLE_PHASES 19
-  
-  long t = hexmillis()%timeperiod;
-  long phase = (NUM_RIPPLE_PHASES*t)/timeperiod;
+  program_t *p = &rippleProgram;
 
-  //Serial.print("PHASE: ");
-  //Serial.println(phase);
+  PROGRAM_BEGIN(p);
+  for (;;) {
+    // new gait parameters are only taken over between two cycles
+    PROGRAM_HOLD(p, gaitCycleBoundary());
+    ripplePhaseTiming(&rippleTiming, hipforward, hipbackward, kneeup, kneedown);
 
-  transactServos();
-  
-  if (phase == 18) {
-    setLeg(ALL_LEGS, hipbackward, NOMOVE, FBSHIFT, turn);
-  } else {
-    int leg = phase/3;  // this will be a number between 0 and 5 because phase==18 is handled above
-    leg = 1<<leg;
-    int subphase = phase%3;
-
-    switch (subphase) {
-      case 0:
-        setLeg(leg, NOMOVE, kneeup, 0);
-        break;
-      case 1:
-        setLeg(leg, hipforward, NOMOVE, FBSHIFT, turn);  // move in "raw" mode if turn is engaged, this makes all legs ripple in the same direction
-        break;
-      case 2:
-        setLeg(leg, NOMOVE, kneedown, 0);
-        break;     
+    for (p->counter = 0; p->counter < NUM_LEGS; p->counter++) {
+      GaitPhase = 3*p->counter;
+      setLeg(1<<p->counter, NOMOVE, kneeup, 0);
+      PROGRAM_AWAIT_ARRIVAL(p, 100, phaseSlot(&rippleTiming, 3*p->counter, timeperiod));
+
+      GaitPhase = 3*p->counter + 1;
+      setLeg(1<<p->counter, hipforward, NOMOVE, FBSHIFT, turn);  // move in "raw" mode if turn is engaged, this makes all legs ripple in the same direction
+      PROGRAM_AWAIT_ARRIVAL(p, 100, phaseSlot(&rippleTiming, 3*p->counter + 1, timeperiod));
+
+      GaitPhase = 3*p->counter + 2;
+      setLeg(1<<p->counter, NOMOVE, kneedown, 0);
+      PROGRAM_AWAIT_ARRIVAL(p, 100, phaseSlot(&rippleTiming, 3*p->counter + 2, timeperiod));
     }
+
+    GaitPhase = 18;
+    setLeg(ALL_LEGS, hipbackward, NOMOVE, FBSHIFT, turn);
+    PROGRAM_AWAIT_ARRIVAL(p, 100, phaseSlot(&rippleTiming, 18, timeperiod));
   }
-  commitServos();
+  PROGRAM_END(p);
 }
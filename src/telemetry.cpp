@@ -0,0 +1,146 @@
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Binary telemetry of the hexapod                                                    */
+/*                                                                                     */
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Copyright 2024 by Bodo Bauer <bb@bb-zone.com>                                      */
+/*                                                                                     */
+/*  This program is free software: you can redistribute it and/or modify               */
+/*  it under the terms of the GNU General Public License as published by               */
+/*  the Free Software Foundation, either version 3 of the License, or                  */
+/*  (at your option) any later version.                                                */
+/*                                                                                     */
+/*  This program is distributed in the hope that it will be useful,                    */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of                     */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                      */
+/*  GNU General Public License for more details.                                       */
+/*                                                                                     */
+/*  You should have received a copy of the GNU General Public License                  */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.              */
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include "mqtt.h"
+#include "telemetry.h"
+#include "kinematics.h"
+
+extern byte botMode;
+extern byte botSubmode;
+extern byte botCommand;
+
+/* *********************************************************************************** *
+ * Every TelemetryPeriod a sample of the robot state is taken. Samples which do not
+ * differ from the last one kept are skipped, apart from small changes of noisy values
+ * like the loop rate or the free heap. Kept samples are collected in a frame which is 
+ * published as a binary MQTT message as soon as it is full or its first sample 
+ * is TELEMETRY_MAX_AGE old. See the README for the frame layout.
+ * *********************************************************************************** */
+
+unsigned int TelemetryPeriod = TELEMETRY_PERIOD;
+
+static telemetryframe_t  frame;
+static_assert(sizeof(telemetryframe_t) < MQTT_MSG_LEN, "a telemetry frame has to fit into an MQTT message");
+static telemetrysample_t lastKept;
+static unsigned long     lastKeptTime = 0;
+
+/* *********************************************************************************** */
+/* @brief See if a sample differs enough from the last one kept                        */
+/* *********************************************************************************** */
+bool telemetryChanged(const telemetrysample_t *s) {
+  if (s->mode != lastKept.mode || s->submode != lastKept.submode || s->command != lastKept.command ||
+      s->phase != lastKept.phase || s->sleepRecoveries != lastKept.sleepRecoveries ||
+      memcmp(s->joint, lastKept.joint, sizeof(s->joint))) {
+    return true;
+  }
+  if (abs((long)s->loopRate - lastKept.loopRate)*100 > (long)lastKept.loopRate*TELEMETRY_LOOPRATE_BAND ||
+      abs((long)s->freeHeap - lastKept.freeHeap) > TELEMETRY_HEAP_BAND ||
+      abs(s->rssi - lastKept.rssi) >= TELEMETRY_RSSI_BAND ||
+      abs(s->queueDepth - lastKept.queueDepth) >= TELEMETRY_QUEUE_BAND) {
+    return true;
+  }
+  return false;
+}
+
+/* *********************************************************************************** */
+/* @brief Publish the frame collected so far                                           */
+/* *********************************************************************************** */
+void publishTelemetry(void) {
+  if (frame.count == 0) {
+    return;
+  }
+  frame.version = TELEMETRY_VERSION;
+  mqttSendData("/%s/Telemetry", (const byte*)&frame, 
+               sizeof(frame) - (TELEMETRY_BATCH - frame.count)*sizeof(telemetrysample_t));
+  frame.count = 0;
+}
+
+/* *********************************************************************************** *
+ * @brief Telemetry task
+ *
+ * Runs in every loop to measure the loop rate, samples every TelemetryPeriod.
+ * *********************************************************************************** */
+void telemetry(void*) {
+  static unsigned long loops = 0;
+  static unsigned long lastSample = 0;
+  unsigned long now = millis();
+
+  loops++;
+  if (TelemetryPeriod == 0) {
+    publishTelemetry();                 // whatever has been collected before switching off
+    return;
+  }
+  if (now - lastSample < TelemetryPeriod) {
+    return;
+  }
+
+  telemetrysample_t s;
+  s.offset     = 0;
+  s.loopRate   = min((loops * 1000) / (now - lastSample), 0xFFFFUL);
+  s.mode       = botMode;
+  s.submode    = botSubmode;
+  s.command    = botCommand;
+  s.phase      = GaitPhase;
+  for (int servo = 0; servo < NUM_SERVO; servo++) {
+    s.joint[servo] = servoPosition(servo);
+  }
+  s.sleepRecoveries = ServoSleepRecoveries;
+  s.freeHeap   = min(ESP.getFreeHeap(), (uint32_t)0xFFFF);
+  s.rssi       = WiFi.RSSI();
+  s.queueDepth = MqttQueueDepth;
+  for (int leg = 0; leg < NUM_LEGS; leg++) {
+    unsigned short hip  = servoPosition(leg);
+    unsigned short knee = servoPosition(leg + KNEE_OFFSET);
+    if (hip == SERVO_UNKNOWN || knee == SERVO_UNKNOWN) {
+      s.foot[leg][0] = s.foot[leg][1] = s.foot[leg][2] = TELEMETRY_NO_FOOT;
+    } else {
+      foot_t f;
+      footPosition(leg, hip, knee, &f);
+      s.foot[leg][0] = f.x;
+      s.foot[leg][1] = f.y;
+      s.foot[leg][2] = f.z;
+    }
+  }
+  loops        = 0;
+  lastSample   = now;
+
+  if (telemetryChanged(&s) || now - lastKeptTime >= TELEMETRY_KEEPALIVE) {
+    if (frame.count == 0) {
+      frame.time = now;
+    }
+    s.offset = now - frame.time;
+    frame.sample[frame.count++] = s;
+    lastKept     = s;
+    lastKeptTime = now;
+  }
+
+  if (frame.count == TELEMETRY_BATCH || (frame.count > 0 && now - frame.time >= TELEMETRY_MAX_AGE)) {
+    publishTelemetry();
+  }
+}
+
+/* *********************************************************************************** */
+/* @brief Set the sample period in ms, 0 switches telemetry off                        */
+/* *********************************************************************************** */
+void setTelemetryPeriod(unsigned int ms) {
+  TelemetryPeriod = (ms == 0) ? 0 : constrain(ms, 20, 60000);
+}
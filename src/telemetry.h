@@ -0,0 +1,80 @@
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Binary telemetry of the hexapod                                                    */
+/*                                                                                     */
+/* *********************************************************************************** */
+/*                                                                                     */
+/*  Copyright 2024 by Bodo Bauer <bb@bb-zone.com>                                      */
+/*                                                                                     */
+/*  This program is free software: you can redistribute it and/or modify               */
+/*  it under the terms of the GNU General Public License as published by               */
+/*  the Free Software Foundation, either version 3 of the License, or                  */
+/*  (at your option) any later version.                                                */
+/*                                                                                     */
+/*  This program is distributed in the hope that it will be useful,                    */
+/*  but WITHOUT ANY WARRANTY; without even the implied warranty of                     */
+/*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                      */
+/*  GNU General Public License for more details.                                       */
+/*                                                                                     */
+/*  You should have received a copy of the GNU General Public License                  */
+/*  along with this program.  If not, see <http://www.gnu.org/licenses/>.              */
+#include <Arduino.h>
+#include "legs.h"
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+/* *********************************************************************************** */
+/* Telemetry settings                                                                  */
+/* *********************************************************************************** */
+
+#define TELEMETRY_VERSION       2   // first byte of every frame
+#define TELEMETRY_PERIOD      100   // default sample period in ms
+#define TELEMETRY_BATCH         4   // samples per frame, a frame has to fit into MQTT_MSG_LEN
+#define TELEMETRY_MAX_AGE    1000   // publish a frame at the latest when its first sample is this old
+#define TELEMETRY_KEEPALIVE 10000   // keep a sample at least this often, even if nothing changed
+
+// unchanged samples are skipped, these changes of noisy values do not count
+#define TELEMETRY_LOOPRATE_BAND  10   // percent
+#define TELEMETRY_HEAP_BAND    1024   // bytes
+#define TELEMETRY_RSSI_BAND       3   // dBm
+#define TELEMETRY_QUEUE_BAND      2   // messages, the telemetry frames are queued themselves
+
+#define TELEMETRY_NO_FOOT  (-32768)   // position of a foot whose joints are unknown
+
+extern unsigned int TelemetryPeriod;
+
+/* *********************************************************************************** */
+/* Custom Types                                                                        */
+/* *********************************************************************************** */
+
+typedef struct __attribute__((packed)) {   // one sample, all values little endian
+  uint16_t offset;               // ms since the first sample of the frame
+  uint16_t loopRate;             // loop() runs per second
+  uint8_t  mode;                 // bot mode, submode and command as in hexabot.h
+  uint8_t  submode;
+  uint8_t  command;
+  uint8_t  phase;                // phase of the running gait
+  uint16_t joint[NUM_SERVO];     // positions sent to the servos in 1/16 degree, 0xFFFF if unknown
+  uint16_t sleepRecoveries;      // times the servo driver had to be woken up
+  uint16_t freeHeap;             // bytes
+  int8_t   rssi;                 // Wi-Fi signal strength in dBm
+  uint8_t  queueDepth;           // messages in the MQTT outbound queue
+  int16_t  foot[NUM_LEGS][3];    // x, y, z of the feet in mm (body frame), TELEMETRY_NO_FOOT if unknown
+} telemetrysample_t;
+
+typedef struct __attribute__((packed)) {   // payload of a /<myId>/Telemetry message
+  uint8_t  version;              // TELEMETRY_VERSION
+  uint8_t  count;                // number of samples that follow
+  uint32_t time;                 // millis() at the first sample
+  telemetrysample_t sample[TELEMETRY_BATCH];
+} telemetryframe_t;
+
+/* *********************************************************************************** */
+/* Prototypes                                                                          */
+/* *********************************************************************************** */
+
+void telemetry(void*);                        // run in every loop
+void setTelemetryPeriod(unsigned int ms);     // sample period, 0 disables telemetry
+
+#endif
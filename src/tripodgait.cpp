@@ -28,28 +28,47 @@
 /*  along with this program.  If not, see <http://www.gnu.org/licenses/>.              */
 /* *********************************************************************************** */
 #include "tripodgait.h"
+#include "program.h"
+#include "motion.h"
+#include "log.h"
 
 extern int           ScamperPhase;
 extern long          ScamperTracker;
 extern unsigned long NextScamperPhaseTime;
 
 #define NUM_TURN_PHASES 6
-#define FBSHIFT_TURN    40   // shift front legs back, back legs forward, this much
+#define FBSHIFT_TURN    (GaitParams.turnShift)  // shift front legs back, back legs forward, this much
 
 // for scamper mode
 #define SCAMPERPHASES 6
-#define KNEEDELAY 35
-#define HIPDELAY 100
+#define SCAMPER_KNEE_PROGRESS 50  // start the next phase when knees made this many percent of their move
+
+// for the scamper governor, effort is counted in milliseconds of scampering
+#define SCAMPER_THROTTLE    12000L  // effort at which scamper starts to slow down
+#define SCAMPER_BUDGET      20000L  // effort at which we fall back to the regular tripod gait
+#define SCAMPER_COOLDOWN    10000L  // how long to stay in regular tripod after exhausting the budget
+#define SCAMPER_MAX_STRETCH   100   // phase delays grow by up to this many percent while throttling
 
 // for tripod mode
 #define NUM_TRIPOD_PHASES 6
-#define FBSHIFT    15   // shift front legs back, back legs forward, this much
+#define FBSHIFT    (GaitParams.fbShift)   // shift front legs back, back legs forward, this much
 
 /* *********************************************************************************** *
- * local prototypes
+ * local prototypes and motion programs
  * *********************************************************************************** */
 
+static program_t tripodProgram = { 0, 0, COMMAND_NONE, false, 0 };
+static program_t turnProgram   = { 0, 0, COMMAND_NONE, false, 0 };
+
+static const byte TripodPhaseKinds[NUM_TRIPOD_PHASES] = { PHASE_LIFT, PHASE_PUSH, PHASE_LOWER, 
+                                                          PHASE_LIFT, PHASE_PUSH, PHASE_LOWER };
+static phasetiming_t tripodTiming;
+static phasetiming_t turnTiming;
+
+void tripodPhaseTiming(phasetiming_t *timing, int hipforward, int hipbackward, int kneeup, int kneedown);
 void gait_tripod_scamper(int reverse, int turn);
+bool scamperAllowed(void);
+long scamperDelay(long delay);
 void gait_tripod(int reverse, int hipforward, int hipbackward, int kneeup, int kneedown, long timeperiod); 
 void gait_tripod(int reverse, int hipforward, int hipbackward, int kneeup, int kneedown, long timeperiod, int leanangle);
 void turn(int ccw, int hipforward, int hipbackward, int kneeup, int kneedown, long timeperiod);
@@ -60,6 +79,24 @@ void turn(int ccw, int hipforward, int hipbackward, int kneeup, int kneedown, lo
  * *********************************************************************************** */
 void walkTripodGait(byte command, byte submode) {
   int direction = 0;
+
+  PROGRAM_RESUME(&tripodProgram, command);
+  PROGRAM_RESUME(&turnProgram, command);
+
+  // submode 4 scampers as long as the governor allows it, otherwise use the regular tripod
+  if (submode == SUBMODE_4) {
+    if (scamperAllowed()) {
+      switch (command) {
+        case COMMAND_FORWARD:  gait_tripod_scamper(0, 0); return;
+        case COMMAND_BACKWARD: gait_tripod_scamper(1, 0); return;
+        case COMMAND_RIGHT:    gait_tripod_scamper(0, 1); return;
+        case COMMAND_LEFT:     gait_tripod_scamper(1, 1); return;
+      }
+    }
+    submode = SUBMODE_1;
+    frameContext(MODE_WALK, submode, command);  // keep the frames apart from the scamper frames
+  }
+
   int factor    = (submode == SUBMODE_2) ? 2 : 1;
 
   // process commands
@@ -92,19 +129,81 @@ void walkTripodGait(byte command, byte submode) {
   }
 }
 
+/* *********************************************************************************** *
+ * @brief Keep track of the effort spent scampering
+ *
+ * Needs to be called once per loop. Every millisecond spent in scamper mode adds to the 
+ * ScamperTracker, every millisecond spent otherwise takes away from it. This way the
+ * budget refills while the robot is walking slowly or standing still.
+ * *********************************************************************************** */
+static bool scamperActive = false;      // scamper gait ran since the last governor update
+
+void updateScamperGovernor(void) {
+  static unsigned long lastUpdate = 0;
+  unsigned long now = millis();         // do NOT use hexmillis here, we want real time
+
+  if (lastUpdate == 0) {
+    lastUpdate = now;
+  }
+  long elapsed = now - lastUpdate;
+  lastUpdate = now;
+
+  if (scamperActive) {
+    ScamperTracker += elapsed;
+  } else {
+    ScamperTracker -= elapsed;
+    if (ScamperTracker < 0) {
+      ScamperTracker = 0;
+    }
+  }
+  scamperActive = false;
+}
+
+/* *********************************************************************************** *
+ * @brief Decide if we can afford to scamper
+ *
+ * Scamper is suppressed for a while after the servo driver went to sleep (see 
+ * checkForServoSleep()) or when the effort budget has been used up. The budget is only
+ * enforced while all legs are on the ground, so we never switch gaits mid stride.
+ * *********************************************************************************** */
+bool scamperAllowed(void) {
+  if (millis() < SuppressScamperUntil) {
+    return false;
+  }
+  if (ScamperTracker >= SCAMPER_BUDGET && (ScamperPhase == 2 || ScamperPhase == 5)) {
+    SuppressScamperUntil = millis() + SCAMPER_COOLDOWN;
+    motionReport("/%s/Debug", "Scamper suppressed, effort budget exhausted");
+    LOG_INFO(LOG_SCAMPER_OFF, ScamperTracker);
+    return false;
+  }
+  return true;
+}
+
+/* *********************************************************************************** *
+ * @brief Stretch scamper phase delays when getting close to the effort budget
+ *
+ * Between SCAMPER_THROTTLE and SCAMPER_BUDGET the delays grow linearly by up to
+ * SCAMPER_MAX_STRETCH percent, which slows the robot down gradually before the 
+ * governor falls back to the regular tripod gait.
+ * *********************************************************************************** */
+long scamperDelay(long delay) {
+  long effort = constrain(ScamperTracker, SCAMPER_THROTTLE, SCAMPER_BUDGET) - SCAMPER_THROTTLE;
+  long stretch = (effort * SCAMPER_MAX_STRETCH) / (SCAMPER_BUDGET - SCAMPER_THROTTLE);
+  return delay + (delay * stretch) / 100;
+}
+
 /* *********************************************************************************** *
  * @brief this is a tripod gait that tries to go as fast as possible 
  * 
- * It is not waiting for knee motions to complete before beginning the next hip motion 
- * this was experimentally determined and assumes the battery is maintaining +5v to 
- * the servos and they are MG90S or equivalent speed. There is very little room left
- * for slower servo motion. If the battery voltage drops below 6.5V then the BEC may
- * not be able to maintain 5.0V to the servos and they may not complete motions fast
- *  enough for this to work.Process walking commands in Tripod Gait manner
+ * It is not waiting for knee motions to complete before beginning the next hip motion.
+ * Phase times are taken from the servo speed model (see servosRemaining()), so the
+ * gait adapts to the configured servo speed and supply voltage. If the battery voltage
+ * drops below 6.5V then the BEC may not be able to maintain 5.0V to the servos and 
+ * they may not complete motions fast enough for this to work.
  * *********************************************************************************** */
 void gait_tripod_scamper(int reverse, int turn) {
 
-  ScamperTracker += 2;  // for tracking if the user is over-doing it with scamper
+  scamperActive = true;  // for tracking if the user is over-doing it with scamper
 
   int hipforward, hipbackward;
   
@@ -116,87 +215,101 @@ void gait_tripod_scamper(int reverse, int turn) {
     hipbackward = HIP_BACKWARD;
   }
 
-  if (millis() >= NextScamperPhaseTime) {
+  bool newPhase = false;
+  if (millis() >= NextScamperPhaseTime && 
+      !(ScamperPhase == SCAMPERPHASES-1 && gaitCycleBoundary())) {   // hold for new gait parameters
     ScamperPhase++;
     if (ScamperPhase >= SCAMPERPHASES) {
       ScamperPhase = 0;
     }
-    switch (ScamperPhase) {
-      case 0: NextScamperPhaseTime = millis()+KNEEDELAY; break;
-      case 1: NextScamperPhaseTime = millis()+HIPDELAY; break;
-      case 2: NextScamperPhaseTime = millis()+KNEEDELAY; break;
-      case 3: NextScamperPhaseTime = millis()+KNEEDELAY; break;
-      case 4: NextScamperPhaseTime = millis()+HIPDELAY; break;
-      case 5: NextScamperPhaseTime = millis()+KNEEDELAY; break;
-    }
+    newPhase = true;
   }
 
   //Serial.print("ScamperPhase: "); Serial.println(ScamperPhase);
 
-  transactServos();
-  switch (ScamperPhase) {
-    case 0:
-      // in this phase, center-left and noncenter-right legs raise up at
-      // the knee
-      setLeg(TRIPOD1_LEGS, NOMOVE, KNEE_SCAMPER, 0);
-      setLeg(TRIPOD2_LEGS, NOMOVE, KNEE_DOWN, 0);
-      break;
-
-    case 1:
-      // in this phase, the center-left and noncenter-right legs move forward
-      // at the hips, while the rest of the legs move backward at the hip
-      setLeg(TRIPOD1_LEGS, hipforward, NOMOVE, FBSHIFT, turn);
-      setLeg(TRIPOD2_LEGS, hipbackward, NOMOVE, FBSHIFT, turn);
-      break;
-
-    case 2: 
-      // now put the first set of legs back down on the ground
-      setLeg(TRIPOD1_LEGS, NOMOVE, KNEE_DOWN, 0);
-      setLeg(TRIPOD2_LEGS, NOMOVE, KNEE_DOWN, 0);
-      break;
-
-    case 3:
-      // lift up the other set of legs at the knee
-      setLeg(TRIPOD2_LEGS, NOMOVE, KNEE_SCAMPER, 0, turn);
-      setLeg(TRIPOD1_LEGS, NOMOVE, KNEE_DOWN, 0, turn);
-      break;
+  if (!frameCached(ScamperPhase)) {
+    switch (ScamperPhase) {
+      case 0:
+        // in this phase, center-left and noncenter-right legs raise up at
+        // the knee
+        setLeg(TRIPOD1_LEGS, NOMOVE, KNEE_SCAMPER, 0);
+        setLeg(TRIPOD2_LEGS, NOMOVE, KNEE_DOWN, 0);
+        break;
+
+      case 1:
+        // in this phase, the center-left and noncenter-right legs move forward
+        // at the hips, while the rest of the legs move backward at the hip
+        setLeg(TRIPOD1_LEGS, hipforward, NOMOVE, FBSHIFT, turn);
+        setLeg(TRIPOD2_LEGS, hipbackward, NOMOVE, FBSHIFT, turn);
+        break;
+
+      case 2: 
+        // now put the first set of legs back down on the ground
+        setLeg(TRIPOD1_LEGS, NOMOVE, KNEE_DOWN, 0);
+        setLeg(TRIPOD2_LEGS, NOMOVE, KNEE_DOWN, 0);
+        break;
+
+      case 3:
+        // lift up the other set of legs at the knee
+        setLeg(TRIPOD2_LEGS, NOMOVE, KNEE_SCAMPER, 0, turn);
+        setLeg(TRIPOD1_LEGS, NOMOVE, KNEE_DOWN, 0, turn);
+        break;
       
-    case 4:
-      // similar to phase 1, move raised legs forward and lowered legs backward
-      setLeg(TRIPOD1_LEGS, hipbackward, NOMOVE, FBSHIFT, turn);
-      setLeg(TRIPOD2_LEGS, hipforward, NOMOVE, FBSHIFT, turn);
-      break;
-
-    case 5:
-      // put the second set of legs down, and the cycle repeats
-      setLeg(TRIPOD2_LEGS, NOMOVE, KNEE_DOWN, 0);
-      setLeg(TRIPOD1_LEGS, NOMOVE, KNEE_DOWN, 0);
-      break;  
+      case 4:
+        // similar to phase 1, move raised legs forward and lowered legs backward
+        setLeg(TRIPOD1_LEGS, hipbackward, NOMOVE, FBSHIFT, turn);
+        setLeg(TRIPOD2_LEGS, hipforward, NOMOVE, FBSHIFT, turn);
+        break;
+
+      case 5:
+        // put the second set of legs down, and the cycle repeats
+        setLeg(TRIPOD2_LEGS, NOMOVE, KNEE_DOWN, 0);
+        setLeg(TRIPOD1_LEGS, NOMOVE, KNEE_DOWN, 0);
+        break;  
+    }
+    cacheFrame(ScamperPhase);
   }
   commitServos();
+
+  // knee phases only wait until the legs are clear of the ground, hip phases until the
+  // hips are predicted to have arrived
+  if (newPhase) {
+    int progress = (ScamperPhase == 1 || ScamperPhase == 4) ? 100 : SCAMPER_KNEE_PROGRESS;
+    NextScamperPhaseTime = millis() + scamperDelay(servosRemaining(progress));
+  }
+}
+
+/* *********************************************************************************** *
+ * @brief Share of the cycle time for each phase of the tripod gait and turn
+ *
+ * Knee phases get less time than hip phases, see phaseWeights().
+ * *********************************************************************************** */
+void tripodPhaseTiming(phasetiming_t *timing, int hipforward, int hipbackward, int kneeup, int kneedown) {
+  const int16_t configured[NUM_PHASE_KINDS] = { GaitParams.tripodLiftWeight, 0, 
+                                                GaitParams.tripodLowerWeight, GaitParams.tripodPushWeight };
+  long weight[NUM_PHASE_KINDS];
+  phaseWeights(weight, configured, kneeup - kneedown, hipforward - hipbackward);
+  setPhaseTiming(timing, TripodPhaseKinds, NUM_TRIPOD_PHASES, weight);
 }
 
 /* *********************************************************************************** *
  * @brief walk in tripog gait (this version makes leanangle zero)
  * 
- * The gait consists of 6 phases. This code determines what phase we are currently
- * in by using the millis clock modulo the desired time period that all six phases
- * should consume.
- * 
- * Right now each phase is an equal amount of time but this may not be optimal
+ * The gait consists of 6 phases. A phase ends as soon as the servos are predicted to
+ * have reached their positions, but never takes longer than its share of the desired 
+ * time period (see tripodPhaseTiming()), or when the command changes.
  * *********************************************************************************** */
 void gait_tripod(int reverse, int hipforward, int hipbackward, int kneeup, int kneedown, long timeperiod) {
     gait_tripod(reverse, hipforward, hipbackward, kneeup, kneedown, timeperiod, 0);      
 }
 
 /* *********************************************************************************** *
- * @brief walk in tripog gait (this version makes leanangle zero)
- * 
- * The gait consists of 6 phases. This code determines what phase we are currently
- * in by using the millis clock modulo the desired time period that all six phases
- * should consume.
+ * @brief walk in tripog gait
  * 
- * Right now each phase is an equal amount of time but this may not be optimal
+ * The gait consists of 6 phases. A phase ends as soon as the servos are predicted to
+ * have reached their positions, but never takes longer than its share of the desired 
+ * time period (see tripodPhaseTiming()), or when the command changes. The servo frame
+ * is committed by the motion task.
  * *********************************************************************************** */
 void gait_tripod(int reverse, int hipforward, int hipbackward, int kneeup, int kneedown, long timeperiod, int leanangle) {
   if (reverse) {
@@ -204,47 +317,50 @@ void gait_tripod(int reverse, int hipforward, int hipbackward, int kneeup, int k
     hipforward = hipbackward;
     hipbackward = tmp;
   }
-  
-  long t = hexmillis()%timeperiod;
-  long phase = (NUM_TRIPOD_PHASES*t)/timeperiod;
-
-  transactServos(); // defer leg motions until after checking for crashes
-  switch (phase) {
-    case 0:
-      // in this phase, center-left and noncenter-right legs raise up at
-      // the knee
-      setLeg(TRIPOD1_LEGS, NOMOVE, kneeup, 0, 0, leanangle);
-      break;
-
-    case 1:
-      // in this phase, the center-left and noncenter-right legs move forward
-      // at the hips, while the rest of the legs move backward at the hip
-      setLeg(TRIPOD1_LEGS, hipforward, NOMOVE, FBSHIFT);
-      setLeg(TRIPOD2_LEGS, hipbackward, NOMOVE, FBSHIFT);
-      break;
 
-    case 2: 
-      // now put the first set of legs back down on the ground
-      setLeg(TRIPOD1_LEGS, NOMOVE, kneedown, 0, 0, leanangle);
-      break;
-
-    case 3:
-      // lift up the other set of legs at the knee
-      setLeg(TRIPOD2_LEGS, NOMOVE, kneeup, 0, 0, leanangle);
-      break;
-      
-    case 4:
-      // similar to phase 1, move raised legs forward and lowered legs backward
-      setLeg(TRIPOD1_LEGS, hipbackward, NOMOVE, FBSHIFT);
-      setLeg(TRIPOD2_LEGS, hipforward, NOMOVE, FBSHIFT);
-      break;
-
-    case 5:
-      // put the second set of legs down, and the cycle repeats
-      setLeg(TRIPOD2_LEGS, NOMOVE, kneedown, 0, 0, leanangle);
-      break;  
+  program_t *p = &tripodProgram;
+
+  PROGRAM_BEGIN(p);
+  for (;;) {
+    // new gait parameters are only taken over between two cycles
+    PROGRAM_HOLD(p, gaitCycleBoundary());
+    tripodPhaseTiming(&tripodTiming, hipforward, hipbackward, kneeup, kneedown);
+
+    // in this phase, center-left and noncenter-right legs raise up at
+    // the knee
+    GaitPhase = 0;
+    setLeg(TRIPOD1_LEGS, NOMOVE, kneeup, 0, 0, leanangle);
+    PROGRAM_AWAIT_ARRIVAL(p, 100, phaseSlot(&tripodTiming, 0, timeperiod));
+
+    // in this phase, the center-left and noncenter-right legs move forward
+    // at the hips, while the rest of the legs move backward at the hip
+    GaitPhase = 1;
+    setLeg(TRIPOD1_LEGS, hipforward, NOMOVE, FBSHIFT);
+    setLeg(TRIPOD2_LEGS, hipbackward, NOMOVE, FBSHIFT);
+    PROGRAM_AWAIT_ARRIVAL(p, 100, phaseSlot(&tripodTiming, 1, timeperiod));
+
+    // now put the first set of legs back down on the ground
+    GaitPhase = 2;
+    setLeg(TRIPOD1_LEGS, NOMOVE, kneedown, 0, 0, leanangle);
+    PROGRAM_AWAIT_ARRIVAL(p, 100, phaseSlot(&tripodTiming, 2, timeperiod));
+
+    // lift up the other set of legs at the knee
+    GaitPhase = 3;
+    setLeg(TRIPOD2_LEGS, NOMOVE, kneeup, 0, 0, leanangle);
+    PROGRAM_AWAIT_ARRIVAL(p, 100, phaseSlot(&tripodTiming, 3, timeperiod));
+
+    // similar to phase 1, move raised legs forward and lowered legs backward
+    GaitPhase = 4;
+    setLeg(TRIPOD1_LEGS, hipbackward, NOMOVE, FBSHIFT);
+    setLeg(TRIPOD2_LEGS, hipforward, NOMOVE, FBSHIFT);
+    PROGRAM_AWAIT_ARRIVAL(p, 100, phaseSlot(&tripodTiming, 4, timeperiod));
+
+    // put the second set of legs down, and the cycle repeats
+    GaitPhase = 5;
+    setLeg(TRIPOD2_LEGS, NOMOVE, kneedown, 0, 0, leanangle);
+    PROGRAM_AWAIT_ARRIVAL(p, 100, phaseSlot(&tripodTiming, 5, timeperiod));
   }
-  commitServos(); // implement all leg motions
+  PROGRAM_END(p);
 }
 
 void turn(int ccw, int hipforward, int hipbackward, int kneeup, int kneedown, long timeperiod) {
@@ -258,43 +374,48 @@ void turn(int ccw, int hipforward, int hipbackward, int kneeup, int kneedown, lo
     hipforward = hipbackward;
     hipbackward = tmp;
   }
-  
-  long t = hexmillis()%timeperiod;
-  long phase = (NUM_TURN_PHASES*t)/timeperiod;
-
-  switch (phase) {
-    case 0:
-      // in this phase, center-left and noncenter-right legs raise up at
-      // the knee
-      setLeg(TRIPOD1_LEGS, NOMOVE, kneeup, 0);
-      break;
-
-    case 1:
-      // in this phase, the center-left and noncenter-right legs move clockwise
-      // at the hips, while the rest of the legs move CCW at the hip
-      setLeg(TRIPOD1_LEGS, hipforward, NOMOVE, FBSHIFT_TURN, 1);
-      setLeg(TRIPOD2_LEGS, hipbackward, NOMOVE, FBSHIFT_TURN, 1);
-      break;
-
-    case 2: 
-      // now put the first set of legs back down on the ground
-      setLeg(TRIPOD1_LEGS, NOMOVE, kneedown, 0);
-      break;
 
-    case 3:
-      // lift up the other set of legs at the knee
-      setLeg(TRIPOD2_LEGS, NOMOVE, kneeup, 0);
-      break;
-      
-    case 4:
-      // similar to phase 1, move raised legs CW and lowered legs CCW
-      setLeg(TRIPOD1_LEGS, hipbackward, NOMOVE, FBSHIFT_TURN, 1);
-      setLeg(TRIPOD2_LEGS, hipforward, NOMOVE, FBSHIFT_TURN, 1);
-      break;
-
-    case 5:
-      // put the second set of legs down, and the cycle repeats
-      setLeg(TRIPOD2_LEGS, NOMOVE, kneedown, 0);
-      break;  
-  } 
-}
\ No newline at end of file
+  program_t *p = &turnProgram;
+
+  PROGRAM_BEGIN(p);
+  for (;;) {
+    // new gait parameters are only taken over between two cycles
+    PROGRAM_HOLD(p, gaitCycleBoundary());
+    tripodPhaseTiming(&turnTiming, hipforward, hipbackward, kneeup, kneedown);
+
+    // in this phase, center-left and noncenter-right legs raise up at
+    // the knee
+    GaitPhase = 0;
+    setLeg(TRIPOD1_LEGS, NOMOVE, kneeup, 0);
+    PROGRAM_AWAIT_ARRIVAL(p, 100, phaseSlot(&turnTiming, 0, timeperiod));
+
+    // in this phase, the center-left and noncenter-right legs move clockwise
+    // at the hips, while the rest of the legs move CCW at the hip
+    GaitPhase = 1;
+    setLeg(TRIPOD1_LEGS, hipforward, NOMOVE, FBSHIFT_TURN, 1);
+    setLeg(TRIPOD2_LEGS, hipbackward, NOMOVE, FBSHIFT_TURN, 1);
+    PROGRAM_AWAIT_ARRIVAL(p, 100, phaseSlot(&turnTiming, 1, timeperiod));
+
+    // now put the first set of legs back down on the ground
+    GaitPhase = 2;
+    setLeg(TRIPOD1_LEGS, NOMOVE, kneedown, 0);
+    PROGRAM_AWAIT_ARRIVAL(p, 100, phaseSlot(&turnTiming, 2, timeperiod));
+
+    // lift up the other set of legs at the knee
+    GaitPhase = 3;
+    setLeg(TRIPOD2_LEGS, NOMOVE, kneeup, 0);
+    PROGRAM_AWAIT_ARRIVAL(p, 100, phaseSlot(&turnTiming, 3, timeperiod));
+
+    // similar to phase 1, move raised legs CW and lowered legs CCW
+    GaitPhase = 4;
+    setLeg(TRIPOD1_LEGS, hipbackward, NOMOVE, FBSHIFT_TURN, 1);
+    setLeg(TRIPOD2_LEGS, hipforward, NOMOVE, FBSHIFT_TURN, 1);
+    PROGRAM_AWAIT_ARRIVAL(p, 100, phaseSlot(&turnTiming, 4, timeperiod));
+
+    // put the second set of legs down, and the cycle repeats
+    GaitPhase = 5;
+    setLeg(TRIPOD2_LEGS, NOMOVE, kneedown, 0);
+    PROGRAM_AWAIT_ARRIVAL(p, 100, phaseSlot(&turnTiming, 5, timeperiod));
+  }
+  PROGRAM_END(p);
+}
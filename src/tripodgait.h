@@ -35,5 +35,6 @@
 #define TRIPODGAIT_H
 
 void walkTripodGait(byte command, byte submode);
+void updateScamperGovernor(void);
  
 #endif
\ No newline at end of file
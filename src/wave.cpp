@@ -33,8 +33,8 @@
 #include "hexabot.h"
 
 #define NUM_WAVE_PHASES 12
-#define WAVE_CYCLE_TIME 900
-#define KNEE_WAVE  60
+#define WAVE_CYCLE_TIME (GaitParams.waveCycleTime)
+#define KNEE_WAVE  (GaitParams.waveKnee)
 
 /* *********************************************************************************** *
  * local prototypes
@@ -50,6 +50,13 @@ void wave(byte command) {
   if (command == COMMAND_BACKWARD) {
     phase = 11-phase;  // go backwards
   }
+  if (phase == 0) {
+    gaitCycleBoundary();   // new parameters are applied with the next run
+  }
+  if (frameCached(phase)) {
+    commitServos();
+    return;
+  }
 
   switch (command) {
     case COMMAND_FORWARD:
@@ -113,6 +120,8 @@ void wave(byte command) {
           setKnee(i, KNEE_NEUTRAL);
         }
       }
+      cacheFrame(phase);
+      commitServos();
       return;
       if (phase < NUM_LEGS) {
         setKnee(phase/2, KNEE_UP);
@@ -123,4 +132,6 @@ void wave(byte command) {
       }
       break;
   }
+  cacheFrame(phase);
+  commitServos();
 }
\ No newline at end of file
@@ -21,6 +21,8 @@
 /* *********************************************************************************** */
 
 #include "wifi.h"
+#include "mqtt.h"
+#include "metrics.h"
 #include "serial.h"
 
 /* *********************************************************************************** */
@@ -33,35 +35,111 @@ PubSubClient client(wifiClient);
 char         myId[10];
 bool         otaActive = false;
 
+unsigned long BootStandMs = 0;         // ms after boot the robot was standing
+unsigned long BootWifiMs  = 0;         // ms after boot Wi-Fi was connected
+unsigned long BootMqttMs  = 0;         // ms after boot the MQTT broker was connected
+
+static byte          netState = NET_WIFI;
+static unsigned long netSince = 0;     // millis() when the current state was entered
+static bool          bootReported = false;
+
+static WiFiManagerParameter *paramMqttBroker = NULL;   // created with the persistent data loaded
+static WiFiManagerParameter *paramMqttPort   = NULL;
+
 /* *********************************************************************************** */
-/*  @brief connect to Wifi network                                                     */
+/* @brief Switch the network state machine to a new state                              */
 /* *********************************************************************************** */
+void netEnter(byte state) {
+    netState = state;
+    netSince = millis();
+}
+
+/* *********************************************************************************** *
+ * @brief Start connecting to the Wifi network
+ *
+ * Returns right away, the connection is made by network() in the background.
+ * *********************************************************************************** */
 void initWifi(void) {
     byte mac_address[6];
-    char port[7];
 
-    sprintf(port, "%d", persistentData.mqtt_port);
-    WiFiManagerParameter paramMqttBroker("mqtt_broker", "MQTT Broker", persistentData.mqtt_broker, 40, "Broker");
-    WiFiManagerParameter paramMqttPort("mqtt_port", "MQTT Port", port, 6, "Port");
+    WiFi.macAddress(mac_address);
+    sprintf(myId, "BB-%02x%02x", mac_address[4], mac_address[5]);
 
-    wifiManager.setConfigPortalTimeout(600);
-    wifiManager.addParameter(&paramMqttBroker);
-    wifiManager.addParameter(&paramMqttPort);
+    WiFi.mode(WIFI_STA);
+    WiFi.begin();                      // use the credentials stored by the config portal
+    netEnter(NET_WIFI);
+}
 
-    while (!wifiManager.autoConnect(WIFISSID)) {  
-        // failed to connect, reset and try again...
-        delay(3000);
-        ESP.reset();
-        delay(5000);
-    }
+/* *********************************************************************************** *
+ * @brief Network state machine, call in every loop
+ *
+ * Connects to the Wifi network with the stored credentials. If that does not work 
+ * within NET_WIFI_TIMEOUT, the WiFiManager config portal is opened (without blocking)
+ * for up to NET_PORTAL_TIMEOUT seconds. Once Wifi is up, OTA is started and the MQTT
+ * broker is tried every NET_MQTT_RETRY ms. Lost connections are picked up again.
+ * *********************************************************************************** */
+void network(void) {
+    unsigned long now = millis();
 
-    strcpy(persistentData.mqtt_broker, paramMqttBroker.getValue());
-    persistentData.mqtt_port = atoi(paramMqttPort.getValue());    
-    strcpy(persistentData.magic, EEPROM_MAGIC);
-    WiFi.macAddress(mac_address);
-    sprintf(myId, "BB-%02x%02x", mac_address[4], mac_address[5]);
+    switch (netState) {
+        case NET_WIFI:
+            if (WiFi.status() == WL_CONNECTED) {
+                netEnter(NET_ONLINE);
+            } else if (now - netSince > NET_WIFI_TIMEOUT) {
+                if (paramMqttBroker == NULL) {
+                    char port[7];
+                    sprintf(port, "%d", persistentData.mqtt_port);
+                    paramMqttBroker = new WiFiManagerParameter("mqtt_broker", "MQTT Broker", persistentData.mqtt_broker, 40, "Broker");
+                    paramMqttPort   = new WiFiManagerParameter("mqtt_port", "MQTT Port", port, 6, "Port");
+                    wifiManager.addParameter(paramMqttBroker);
+                    wifiManager.addParameter(paramMqttPort);
+                }
+                wifiManager.setConfigPortalTimeout(NET_PORTAL_TIMEOUT);
+                wifiManager.setConfigPortalBlocking(false);
+                wifiManager.startConfigPortal(WIFISSID);
+                netEnter(NET_PORTAL);
+            }
+            break;
+
+        case NET_PORTAL:
+            if (wifiManager.process()) {
+                strcpy(persistentData.mqtt_broker, paramMqttBroker->getValue());
+                persistentData.mqtt_port = atoi(paramMqttPort->getValue());    
+                strcpy(persistentData.magic, EEPROM_MAGIC);
+                saveToEEPROM();
+                netEnter(NET_ONLINE);
+            } else if (now - netSince > NET_PORTAL_TIMEOUT * 1000UL) {
+                wifiManager.stopConfigPortal();
+                WiFi.begin();
+                netEnter(NET_WIFI);
+            }
+            break;
 
-    saveToEEPROM();
+        case NET_ONLINE:
+            if (WiFi.status() != WL_CONNECTED) {
+                netEnter(NET_WIFI);
+                break;
+            }
+            if (BootWifiMs == 0) {
+                BootWifiMs = now;
+                initOTA();
+                initMetrics();
+            }
+            if (!client.connected() && (BootMqttMs == 0 || now - netSince > NET_MQTT_RETRY)) {
+                netSince = now;
+                if (initMQTT() && BootMqttMs == 0) {
+                    BootMqttMs = millis();
+                }
+            }
+            if (!bootReported && BootMqttMs && BootStandMs) {
+                char message[96];
+                sprintf(message, "Boot sequence complete: stand %lums wifi %lums mqtt %lums", 
+                        BootStandMs, BootWifiMs, BootMqttMs);
+                mqttSendMessage("/%s/Status", message);
+                bootReported = true;
+            }
+            break;
+    }
 }
 
 /* *********************************************************************************** */
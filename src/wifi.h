@@ -39,6 +39,15 @@
 #define MQTT_BROKER "192.168.100.26"
 #define MQTT_PORT   1883
 
+#define NET_WIFI_TIMEOUT   15000L   // try the stored credentials this long before opening the portal
+#define NET_PORTAL_TIMEOUT   600    // seconds the config portal stays open
+#define NET_MQTT_RETRY      5000L   // time between attempts to connect to the MQTT broker
+
+// states of the network state machine
+#define NET_WIFI    1   // waiting for the Wifi connection
+#define NET_PORTAL  2   // config portal open
+#define NET_ONLINE  3   // Wifi connected, MQTT connected or retried
+
 /* *********************************************************************************** */
 /* Exported globals                                                                    */
 /* *********************************************************************************** */
@@ -47,11 +56,15 @@ extern WiFiManager  wifiManager;
 extern PubSubClient client;
 extern bool         otaActive;
 extern char         myId[10];
+extern unsigned long BootStandMs;
+extern unsigned long BootWifiMs;
+extern unsigned long BootMqttMs;
 
 /* *********************************************************************************** */
 /* Prototypes                                                                          */
 /* *********************************************************************************** */
-void initWifi(void);                           // Board Initialisation, Wifi Connect
+void initWifi(void);                           // Board Initialisation, start Wifi Connect
+void network(void);                            // bring up and keep up Wifi and MQTT (call in loop)
 void resetWifi(void);                          // Force WLAN to be reset
 void initOTA(void);                            // Allow update over the air
 